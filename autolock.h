@@ -32,6 +32,8 @@ class AutoLock {
   AutoLock &operator=(const AutoLock &rhs) = delete;
 
   int Lock();
+  // Returns -EBUSY instead of waiting if the mutex is already held
+  int TryLock();
   int Unlock();
 
  private:
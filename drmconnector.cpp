@@ -21,7 +21,10 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <algorithm>
+#include <unordered_map>
 
+#include <drm/drm_fourcc.h>
 #include <log/log.h>
 #include <xf86drmMode.h>
 
@@ -38,9 +41,26 @@ DrmConnector::DrmConnector(DrmDevice *drm, drmModeConnectorPtr c,
       state_(c->connection),
       mm_width_(c->mmWidth),
       mm_height_(c->mmHeight),
+      modes_(std::make_shared<DrmModeList>()),
       possible_encoders_(possible_encoders) {
 }
 
+DrmConnector::DrmConnector(DrmDevice *drm, const DrmMode &mode)
+    : drm_(drm),
+      id_(0),
+      encoder_(NULL),
+      display_(-1),
+      type_(DRM_MODE_CONNECTOR_VIRTUAL),
+      state_(DRM_MODE_CONNECTED),
+      synthetic_(true),
+      mm_width_(0),
+      mm_height_(0) {
+  auto list = std::make_shared<DrmModeList>();
+  list->modes.push_back(mode);
+  list->preferred_mode_id = mode.id();
+  modes_ = list;
+}
+
 int DrmConnector::Init() {
   int ret = drm_->GetConnectorProperty(*this, "DPMS", &dpms_property_);
   if (ret) {
@@ -52,6 +72,9 @@ int DrmConnector::Init() {
     ALOGE("Could not get CRTC_ID property\n");
     return ret;
   }
+  ret = drm_->GetConnectorProperty(*this, "EDID", &edid_property_);
+  if (ret)
+    ALOGV("Could not get EDID property\n");
   if (writeback()) {
     ret = drm_->GetConnectorProperty(*this, "WRITEBACK_PIXEL_FORMATS",
                                      &writeback_pixel_formats_);
@@ -59,6 +82,20 @@ int DrmConnector::Init() {
       ALOGE("Could not get WRITEBACK_PIXEL_FORMATS connector_id = %d\n", id_);
       return ret;
     }
+    uint64_t blob_id;
+    std::tie(ret, blob_id) = writeback_pixel_formats_.value();
+    drmModePropertyBlobPtr blob =
+        ret ? NULL : drmModeGetPropertyBlob(drm_->fd(), blob_id);
+    if (blob) {
+      const uint32_t *formats = (const uint32_t *)blob->data;
+      writeback_formats_.assign(formats,
+                                formats + blob->length / sizeof(uint32_t));
+      drmModeFreePropertyBlob(blob);
+    } else {
+      // Every writeback driver takes XRGB8888, it's better than nothing
+      ALOGW("Failed to get writeback formats of connector %d", id_);
+      writeback_formats_.assign(1, DRM_FORMAT_XRGB8888);
+    }
     ret = drm_->GetConnectorProperty(*this, "WRITEBACK_FB_ID",
                                      &writeback_fb_id_);
     if (ret) {
@@ -111,7 +148,67 @@ bool DrmConnector::valid_type() const {
   return internal() || external() || writeback();
 }
 
+int DrmConnector::UpdateState() {
+  if (synthetic_)
+    return 0;
+
+  drmModeConnectorPtr c = drmModeGetConnectorCurrent(drm_->fd(), id_);
+  if (!c) {
+    ALOGE("Failed to get connector %d", id_);
+    return -ENODEV;
+  }
+
+  state_ = c->connection;
+  drmModeFreeConnector(c);
+  return 0;
+}
+
+static uint64_t Fnv1aHash(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t HashMode(const DrmMode &mode) {
+  uint32_t fields[] = {mode.clock(),        mode.h_display(),
+                       mode.h_sync_start(), mode.h_sync_end(),
+                       mode.h_total(),      mode.h_skew(),
+                       mode.v_display(),    mode.v_sync_start(),
+                       mode.v_sync_end(),   mode.v_total(),
+                       mode.v_scan(),       mode.flags(),
+                       mode.type()};
+  return Fnv1aHash(0xcbf29ce484222325ULL, fields, sizeof(fields));
+}
+
+uint64_t DrmConnector::GetEdidHash(drmModeConnectorPtr c, uint32_t *blob_id) {
+  *blob_id = 0;
+  if (!edid_property_.id())
+    return 0;
+
+  for (int i = 0; i < c->count_props; ++i) {
+    if (c->props[i] == edid_property_.id()) {
+      *blob_id = c->prop_values[i];
+      break;
+    }
+  }
+  if (!*blob_id)
+    return 0;
+
+  drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_->fd(), *blob_id);
+  if (!blob)
+    return 0;
+  uint64_t hash = Fnv1aHash(0xcbf29ce484222325ULL, blob->data, blob->length);
+  drmModeFreePropertyBlob(blob);
+  return hash;
+}
+
 int DrmConnector::UpdateModes() {
+  if (synthetic_)
+    return 0;
+
   int fd = drm_->fd();
 
   drmModeConnectorPtr c = drmModeGetConnector(fd, id_);
@@ -121,32 +218,89 @@ int DrmConnector::UpdateModes() {
   }
 
   state_ = c->connection;
+  mm_width_ = c->mmWidth;
+  mm_height_ = c->mmHeight;
+
+  // Modes which were already there keep their ids
+  std::shared_ptr<const DrmModeList> old_list = modes();
+  std::unordered_map<uint64_t, const DrmMode *> old_modes;
+  for (const DrmMode &mode : old_list->modes)
+    old_modes.emplace(HashMode(mode), &mode);
 
   bool preferred_mode_found = false;
-  std::vector<DrmMode> new_modes;
+  auto list = std::make_shared<DrmModeList>();
+  std::vector<DrmMode> &new_modes = list->modes;
   for (int i = 0; i < c->count_modes; ++i) {
-    bool exists = false;
-    for (const DrmMode &mode : modes_) {
-      if (mode == c->modes[i]) {
-        new_modes.push_back(mode);
-        exists = true;
-        break;
-      }
-    }
-    if (!exists) {
-      DrmMode m(&c->modes[i]);
+    DrmMode m(&c->modes[i]);
+    auto old_mode = old_modes.find(HashMode(m));
+    if (old_mode != old_modes.end() && *old_mode->second == c->modes[i])
+      m.set_id(old_mode->second->id());
+    else
       m.set_id(drm_->next_mode_id());
-      new_modes.push_back(m);
-    }
+    new_modes.push_back(m);
     if (new_modes.back().type() & DRM_MODE_TYPE_PREFERRED) {
-      preferred_mode_id_ = new_modes.back().id();
+      list->preferred_mode_id = new_modes.back().id();
       preferred_mode_found = true;
     }
   }
-  modes_.swap(new_modes);
-  if ((!preferred_mode_found) && (modes_.size() != 0)) {
-    preferred_mode_id_ = modes_[0].id();
+  if ((!preferred_mode_found) && (new_modes.size() != 0)) {
+    list->preferred_mode_id = new_modes[0].id();
+  }
+  // Virtual connectors offer any mode, the configured one is picked
+  for (const DrmMode &mode : new_modes) {
+    if (drm_->IsHeadlessMode(mode)) {
+      list->preferred_mode_id = mode.id();
+      break;
+    }
+  }
+  std::atomic_store(&modes_, std::shared_ptr<const DrmModeList>(list));
+
+  uint64_t edid_hash = GetEdidHash(c, &edid_blob_id_);
+  drmModeFreeConnector(c);
+
+  if (edid_hash && !list->modes.empty()) {
+    DrmModeCacheEntry entry;
+    entry.modes = list->modes;
+    entry.preferred_mode_id = list->preferred_mode_id;
+    entry.mm_width = mm_width_;
+    entry.mm_height = mm_height_;
+    drm_->UpdateModeCache(edid_hash, entry);
+  }
+  return 0;
+}
+
+int DrmConnector::RestoreCachedModes() {
+  if (synthetic_)
+    return 0;
+
+  drmModeConnectorPtr c = drmModeGetConnectorCurrent(drm_->fd(), id_);
+  if (!c) {
+    ALOGE("Failed to get connector %d", id_);
+    return -ENODEV;
   }
+
+  state_ = c->connection;
+  uint32_t blob_id;
+  uint64_t edid_hash = GetEdidHash(c, &blob_id);
+  drmModeFreeConnector(c);
+
+  // The kernel replaces the EDID blob whenever it reads the EDID. If it's
+  // still the one we last probed, the monitor may have been swapped without
+  // the kernel looking at it.
+  if (!edid_hash || blob_id == edid_blob_id_)
+    return -ENOENT;
+
+  DrmModeCacheEntry entry;
+  if (!drm_->LookupModeCache(edid_hash, &entry))
+    return -ENOENT;
+
+  auto list = std::make_shared<DrmModeList>();
+  list->modes = entry.modes;
+  list->preferred_mode_id = entry.preferred_mode_id;
+  std::atomic_store(&modes_, std::shared_ptr<const DrmModeList>(list));
+  mm_width_ = entry.mm_width;
+  mm_height_ = entry.mm_height;
+  edid_blob_id_ = blob_id;
   return 0;
 }
 
@@ -178,6 +332,20 @@ const DrmProperty &DrmConnector::writeback_out_fence() const {
   return writeback_out_fence_;
 }
 
+bool DrmConnector::IsWritebackFormatSupported(uint32_t format) const {
+  return std::find(writeback_formats_.begin(), writeback_formats_.end(),
+                   format) != writeback_formats_.end();
+}
+
+uint32_t DrmConnector::GetWritebackFormat(uint32_t format) const {
+  if (IsWritebackFormatSupported(format))
+    return format;
+  if (format == DRM_FORMAT_ARGB8888 &&
+      IsWritebackFormatSupported(DRM_FORMAT_XRGB8888))
+    return DRM_FORMAT_XRGB8888;
+  return 0;
+}
+
 DrmEncoder *DrmConnector::encoder() const {
   return encoder_;
 }
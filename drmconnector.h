@@ -23,17 +23,37 @@
 
 #include <stdint.h>
 #include <xf86drmMode.h>
+#include <memory>
 #include <vector>
 
 namespace android {
 
 class DrmDevice;
 
+// The modes of a connector and the one it prefers. Hotplug replaces the list
+// as a whole, readers keep using the snapshot they took.
+struct DrmModeList {
+  std::vector<DrmMode> modes;
+  uint32_t preferred_mode_id = 0;
+};
+
+// The modes probed from a monitor, cached by the hash of its EDID so they can
+// be restored without probing it again when it's reconnected.
+struct DrmModeCacheEntry {
+  std::vector<DrmMode> modes;
+  uint32_t preferred_mode_id = 0;
+  uint32_t mm_width = 0;
+  uint32_t mm_height = 0;
+};
+
 class DrmConnector {
  public:
   DrmConnector(DrmDevice *drm, drmModeConnectorPtr c,
                DrmEncoder *current_encoder,
                std::vector<DrmEncoder *> &possible_encoders);
+  // A connector of a synthetic headless display, which isn't backed by
+  // anything in the kernel and only ever shows mode
+  DrmConnector(DrmDevice *drm, const DrmMode &mode);
   DrmConnector(const DrmProperty &) = delete;
   DrmConnector &operator=(const DrmProperty &) = delete;
 
@@ -48,11 +68,21 @@ class DrmConnector {
   bool external() const;
   bool writeback() const;
   bool valid_type() const;
+  bool synthetic() const {
+    return synthetic_;
+  }
 
   int UpdateModes();
-
-  const std::vector<DrmMode> &modes() const {
-    return modes_;
+  // Refreshes the connection state from what the kernel last probed, without
+  // forcing a new probe (and EDID read) the way UpdateModes() does.
+  int UpdateState();
+  // Restores the modes of a monitor that's been probed before if the kernel
+  // has read its EDID since the last probe. Returns -ENOENT if the monitor
+  // needs to be probed with UpdateModes().
+  int RestoreCachedModes();
+
+  std::shared_ptr<const DrmModeList> modes() const {
+    return std::atomic_load(&modes_);
   }
   const DrmMode &active_mode() const;
   void set_active_mode(const DrmMode &mode);
@@ -62,6 +92,12 @@ class DrmConnector {
   const DrmProperty &writeback_pixel_formats() const;
   const DrmProperty &writeback_fb_id() const;
   const DrmProperty &writeback_out_fence() const;
+  // Whether writeback can write the DRM format, see WRITEBACK_PIXEL_FORMATS
+  bool IsWritebackFormatSupported(uint32_t format) const;
+  // The format buffers imported as format are written in. Writeback has no
+  // alpha to write, so ARGB8888 buffers may be written as XRGB8888. 0 if
+  // neither is supported.
+  uint32_t GetWritebackFormat(uint32_t format) const;
 
   const std::vector<DrmEncoder *> &possible_encoders() const {
     return possible_encoders_;
@@ -74,11 +110,9 @@ class DrmConnector {
   uint32_t mm_width() const;
   uint32_t mm_height() const;
 
-  uint32_t get_preferred_mode_id() const {
-    return preferred_mode_id_;
-  }
-
  private:
+  uint64_t GetEdidHash(drmModeConnectorPtr c, uint32_t *blob_id);
+
   DrmDevice *drm_;
 
   uint32_t id_;
@@ -87,22 +121,26 @@ class DrmConnector {
 
   uint32_t type_;
   drmModeConnection state_;
+  bool synthetic_ = false;
 
   uint32_t mm_width_;
   uint32_t mm_height_;
 
   DrmMode active_mode_;
-  std::vector<DrmMode> modes_;
+  std::shared_ptr<const DrmModeList> modes_;
 
   DrmProperty dpms_property_;
   DrmProperty crtc_id_property_;
   DrmProperty writeback_pixel_formats_;
   DrmProperty writeback_fb_id_;
   DrmProperty writeback_out_fence_;
+  DrmProperty edid_property_;
+  std::vector<uint32_t> writeback_formats_;
 
-  std::vector<DrmEncoder *> possible_encoders_;
+  // EDID blob the modes were last probed from
+  uint32_t edid_blob_id_ = 0;
 
-  uint32_t preferred_mode_id_;
+  std::vector<DrmEncoder *> possible_encoders_;
 };
 }  // namespace android
 
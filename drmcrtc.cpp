@@ -27,7 +27,12 @@
 namespace android {
 
 DrmCrtc::DrmCrtc(DrmDevice *drm, drmModeCrtcPtr c, unsigned pipe)
-    : drm_(drm), id_(c->crtc_id), pipe_(pipe), display_(-1), mode_(&c->mode) {
+    : drm_(drm),
+      id_(c->crtc_id),
+      pipe_(pipe),
+      display_(-1),
+      leased_(false),
+      mode_(&c->mode) {
 }
 
 int DrmCrtc::Init() {
@@ -43,10 +48,20 @@ int DrmCrtc::Init() {
     return ret;
   }
 
+  // Without OUT_FENCE_PTR retire fences come from a timeline that's
+  // signaled by page flip events instead, as do those of frames that are
+  // committed later than they're presented.
   ret = drm_->GetCrtcProperty(*this, "OUT_FENCE_PTR", &out_fence_ptr_property_);
-  if (ret) {
-    ALOGE("Failed to get OUT_FENCE_PTR property");
-    return ret;
+  bool has_out_fence = !ret;
+  if (!has_out_fence)
+    ALOGI("CRTC %d has no OUT_FENCE_PTR, using a sync timeline", id_);
+  if (timeline_.Init()) {
+    if (has_out_fence)
+      ALOGW("No sync timeline for CRTC %d", id_);
+    else
+      ALOGE("CRTC %d has neither OUT_FENCE_PTR nor a sync timeline, frames "
+            "are committed in place and async flips are off",
+            id_);
   }
   return 0;
 }
@@ -68,7 +83,15 @@ void DrmCrtc::set_display(int display) {
 }
 
 bool DrmCrtc::can_bind(int display) const {
-  return display_ == -1 || display_ == display;
+  return !leased_ && (display_ == -1 || display_ == display);
+}
+
+bool DrmCrtc::leased() const {
+  return leased_;
+}
+
+void DrmCrtc::set_leased(bool leased) {
+  leased_ = leased;
 }
 
 const DrmProperty &DrmCrtc::active_property() const {
@@ -82,4 +105,8 @@ const DrmProperty &DrmCrtc::mode_property() const {
 const DrmProperty &DrmCrtc::out_fence_ptr_property() const {
   return out_fence_ptr_property_;
 }
+
+SyncTimeline *DrmCrtc::timeline() {
+  return timeline_.initialized() ? &timeline_ : NULL;
+}
 }  // namespace android
@@ -19,9 +19,11 @@
 
 #include "drmmode.h"
 #include "drmproperty.h"
+#include "synctimeline.h"
 
 #include <stdint.h>
 #include <xf86drmMode.h>
+#include <atomic>
 
 namespace android {
 
@@ -43,22 +45,34 @@ class DrmCrtc {
 
   bool can_bind(int display) const;
 
+  // Leased CRTCs belong to another DRM master and can't be bound
+  bool leased() const;
+  void set_leased(bool leased);
+
   const DrmProperty &active_property() const;
   const DrmProperty &mode_property() const;
   const DrmProperty &out_fence_ptr_property() const;
 
+  // Stands in for OUT_FENCE_PTR if the CRTC doesn't have it, or for frames
+  // that aren't committed right away. NULL if sw_sync isn't available.
+  SyncTimeline *timeline();
+
  private:
   DrmDevice *drm_;
 
   uint32_t id_;
   unsigned pipe_;
   int display_;
+  // Read by the present path without any lock
+  std::atomic<bool> leased_;
 
   DrmMode mode_;
 
   DrmProperty active_property_;
   DrmProperty mode_property_;
   DrmProperty out_fence_ptr_property_;
+
+  SyncTimeline timeline_;
 };
 }  // namespace android
 
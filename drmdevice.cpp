@@ -25,9 +25,14 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <algorithm>
 #include <cinttypes>
 
 #include <cutils/properties.h>
@@ -40,6 +45,7 @@ DrmDevice::DrmDevice() : event_listener_(this) {
 
 DrmDevice::~DrmDevice() {
   event_listener_.Exit();
+  watchdog_.Exit();
 }
 
 std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
@@ -56,6 +62,36 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
     return std::make_tuple(ret, 0);
   }
 
+  // Read before the connectors pick their preferred modes
+  char headless_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.headless", headless_prop, "0");
+  headless_ = atoi(headless_prop);
+  if (headless_) {
+    char scanout_prop[PROPERTY_VALUE_MAX];
+    property_get("hwc.drm.headless.scanout", scanout_prop, "1");
+    scanout_ = atoi(scanout_prop);
+
+    // Comma separated WIDTHxHEIGHT, each optionally followed by @REFRESH.
+    // The first is the mode connectors pick, without any connector there's a
+    // synthetic display for each.
+    char mode_prop[PROPERTY_VALUE_MAX];
+    property_get("hwc.drm.headless.mode", mode_prop, "");
+    char *saveptr = NULL;
+    for (char *entry = strtok_r(mode_prop, ",", &saveptr); entry;
+         entry = strtok_r(NULL, ",", &saveptr)) {
+      HeadlessMode mode;
+      if (sscanf(entry, "%ux%u@%f", &mode.width, &mode.height,
+                 &mode.refresh) < 2 ||
+          !mode.width || !mode.height) {
+        ALOGW("Ignoring malformed headless mode %s", entry);
+        continue;
+      }
+      headless_modes_.push_back(mode);
+      ALOGI("Headless mode %ux%u@%f", mode.width, mode.height, mode.refresh);
+    }
+    ALOGI("Headless on %s, scanout=%d", path, scanout_);
+  }
+
   ret = drmSetClientCap(fd(), DRM_CLIENT_CAP_ATOMIC, 1);
   if (ret) {
     ALOGE("Failed to set atomic cap %d", ret);
@@ -201,6 +237,22 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
     }
   }
 
+  // Without a connector to drive, the displays are made up from the headless
+  // modes. They never get a CRTC, so nothing is committed for them and their
+  // vsync comes from a timer.
+  if (!ret && headless_ && displays_.empty()) {
+    for (const HeadlessMode &headless_mode : headless_modes_) {
+      DrmMode mode = CreateSyntheticMode(headless_mode);
+      mode.set_id(next_mode_id());
+      std::unique_ptr<DrmConnector> conn(new DrmConnector(this, mode));
+      conn->set_display(num_displays);
+      displays_[num_displays] = num_displays;
+      ALOGI("Synthetic display %d %s", num_displays, mode.name().c_str());
+      ++num_displays;
+      connectors_.emplace_back(std::move(conn));
+    }
+  }
+
   if (res)
     drmModeFreeResources(res);
 
@@ -244,17 +296,61 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
     return std::make_tuple(ret, 0);
   }
 
+  ret = watchdog_.Init();
+  if (ret) {
+    ALOGE("Can't initialize ioctl watchdog %d", ret);
+    return std::make_tuple(ret, 0);
+  }
+
+  // Internal panels are always given a CRTC, external connectors only once
+  // something is plugged into them so the remaining CRTCs stay available for
+  // hotplug and writeback.
   for (auto &conn : connectors_) {
-    ret = CreateDisplayPipe(conn.get());
+    if (!conn->internal() || conn->synthetic())
+      continue;
+    ret = BindDisplayPipe(conn.get());
     if (ret) {
-      ALOGE("Failed CreateDisplayPipe %d with %d", conn->id(), ret);
+      ALOGE("Failed BindDisplayPipe %d with %d", conn->id(), ret);
       return std::make_tuple(ret, 0);
     }
-    if (!AttachWriteback(conn.get())) {
-      ALOGI("Display %d has writeback attach to it", conn->display());
-    }
   }
-  return std::make_tuple(ret, displays_.size());
+  for (auto &conn : connectors_) {
+    if (conn->internal() || conn->state() != DRM_MODE_CONNECTED)
+      continue;
+    if (BindDisplayPipe(conn.get()))
+      ALOGW("No CRTC left for connector %d at boot", conn->id());
+  }
+  return std::make_tuple(0, displays_.size());
+}
+
+bool DrmDevice::IsHeadlessMode(const DrmMode &mode) const {
+  if (!headless_ || headless_modes_.empty())
+    return false;
+  const HeadlessMode &headless_mode = headless_modes_.front();
+  return mode.h_display() == headless_mode.width &&
+         mode.v_display() == headless_mode.height &&
+         (headless_mode.refresh == 0.0f ||
+          fabsf(mode.v_refresh() - headless_mode.refresh) < 0.5f);
+}
+
+// Nothing ever scans out the mode of a synthetic display, only its size and
+// refresh rate matter.
+DrmMode DrmDevice::CreateSyntheticMode(const HeadlessMode &headless_mode) {
+  float refresh = headless_mode.refresh > 0.0f ? headless_mode.refresh
+                                               : 60.0f;
+  drmModeModeInfo info;
+  memset(&info, 0, sizeof(info));
+  info.hdisplay = info.hsync_start = info.hsync_end = info.htotal =
+      headless_mode.width;
+  info.vdisplay = info.vsync_start = info.vsync_end = info.vtotal =
+      headless_mode.height;
+  info.clock = (uint32_t)(headless_mode.width * headless_mode.height *
+                          refresh / 1000.0f);
+  info.vrefresh = (uint32_t)(refresh + 0.5f);
+  info.type = DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_USERDEF;
+  snprintf(info.name, sizeof(info.name), "%ux%u", headless_mode.width,
+           headless_mode.height);
+  return DrmMode(&info);
 }
 
 bool DrmDevice::HandlesDisplay(int display) const {
@@ -277,8 +373,7 @@ DrmConnector *DrmDevice::GetWritebackConnectorForDisplay(int display) const {
   return NULL;
 }
 
-// TODO what happens when hotplugging
-DrmConnector *DrmDevice::AvailableWritebackConnector(int display) const {
+DrmConnector *DrmDevice::AvailableWritebackConnector(int display) {
   DrmConnector *writeback_conn = GetWritebackConnectorForDisplay(display);
   DrmConnector *display_conn = GetConnectorForDisplay(display);
   // If we have a writeback already attached to the same CRTC just use that,
@@ -289,7 +384,7 @@ DrmConnector *DrmDevice::AvailableWritebackConnector(int display) const {
 
   // Use another CRTC if available and doesn't have any connector
   for (auto &crtc : crtcs_) {
-    if (crtc->display() == display)
+    if (crtc->display() == display || crtc->display() < 0 || crtc->leased())
       continue;
     display_conn = GetConnectorForDisplay(crtc->display());
     // If we have a display connected don't use it for writeback
@@ -299,6 +394,23 @@ DrmConnector *DrmDevice::AvailableWritebackConnector(int display) const {
     if (writeback_conn)
       return writeback_conn;
   }
+
+  // Otherwise lend a free CRTC to a disconnected display, it's taken back as
+  // soon as a connector needs it.
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  for (auto &conn : connectors_) {
+    if (conn->display() < 0 || conn->state() == DRM_MODE_CONNECTED ||
+        GetCrtcForDisplay(conn->display()))
+      continue;
+    for (auto &crtc : crtcs_) {
+      if (crtc->display() >= 0)
+        continue;
+      crtc->set_display(conn->display());
+      if (!AttachWriteback(crtc.get()))
+        return GetWritebackConnectorForDisplay(conn->display());
+      crtc->set_display(-1);
+    }
+  }
   return NULL;
 }
 
@@ -322,6 +434,28 @@ const std::vector<std::unique_ptr<DrmCrtc>> &DrmDevice::crtcs() const {
   return crtcs_;
 }
 
+bool DrmDevice::LookupModeCache(uint64_t edid_hash, DrmModeCacheEntry *entry) {
+  std::lock_guard<std::mutex> lk(mode_cache_lock_);
+  auto it = mode_cache_.find(edid_hash);
+  if (it == mode_cache_.end())
+    return false;
+  *entry = it->second;
+  return true;
+}
+
+void DrmDevice::UpdateModeCache(uint64_t edid_hash,
+                                const DrmModeCacheEntry &entry) {
+  std::lock_guard<std::mutex> lk(mode_cache_lock_);
+  if (mode_cache_.find(edid_hash) == mode_cache_.end()) {
+    if (mode_cache_order_.size() >= kMaxModeCacheEntries) {
+      mode_cache_.erase(mode_cache_order_.front());
+      mode_cache_order_.pop_front();
+    }
+    mode_cache_order_.push_back(edid_hash);
+  }
+  mode_cache_[edid_hash] = entry;
+}
+
 uint32_t DrmDevice::next_mode_id() {
   return ++mode_id_;
 }
@@ -380,9 +514,8 @@ int DrmDevice::CreateDisplayPipe(DrmConnector *connector) {
   return -ENODEV;
 }
 
-// Attach writeback connector to the CRTC linked to the display_conn
-int DrmDevice::AttachWriteback(DrmConnector *display_conn) {
-  DrmCrtc *display_crtc = display_conn->encoder()->crtc();
+// Attach writeback connector to the CRTC bound to a display
+int DrmDevice::AttachWriteback(DrmCrtc *display_crtc) {
   if (GetWritebackConnectorForDisplay(display_crtc->display()) != NULL) {
     ALOGE("Display already has writeback attach to it");
     return -EINVAL;
@@ -408,6 +541,206 @@ int DrmDevice::AttachWriteback(DrmConnector *display_conn) {
   return -EINVAL;
 }
 
+int DrmDevice::BindDisplayPipe(DrmConnector *connector) {
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  return BindDisplayPipeLocked(connector);
+}
+
+int DrmDevice::BindDisplayPipeLocked(DrmConnector *connector) {
+  int display = connector->display();
+  DrmCrtc *crtc = GetCrtcForDisplay(display);
+  DrmEncoder *enc = connector->encoder();
+  if (crtc && enc && enc->crtc() == crtc && enc->display() == display)
+    return 0;
+
+  // A CRTC only lent to the display for writeback isn't necessarily one the
+  // connector can be driven by
+  int ret = ReleaseDisplayPipeLocked(display);
+  if (ret)
+    return ret;
+
+  ret = CreateDisplayPipe(connector);
+  if (ret == -ENODEV) {
+    for (auto &conn : connectors_) {
+      if (conn.get() == connector || conn->display() < 0 ||
+          conn->state() == DRM_MODE_CONNECTED)
+        continue;
+      DrmCrtc *crtc = GetCrtcForDisplay(conn->display());
+      if (crtc && crtc->leased())
+        continue;
+      ReleaseDisplayPipeLocked(conn->display());
+    }
+    ret = CreateDisplayPipe(connector);
+  }
+  if (ret)
+    return ret;
+
+  if (!AttachWriteback(connector->encoder()->crtc()))
+    ALOGI("Display %d has writeback attach to it", display);
+  return 0;
+}
+
+int DrmDevice::ReleaseDisplayPipe(DrmConnector *connector) {
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  return ReleaseDisplayPipeLocked(connector->display());
+}
+
+// Switches off the CRTC bound to the display and detaches it from the
+// display's connector and writeback connector, both in the kernel and here.
+int DrmDevice::ReleaseDisplayPipeLocked(int display) {
+  DrmCrtc *crtc = GetCrtcForDisplay(display);
+  if (!crtc)
+    return 0;
+  if (crtc->leased())
+    return -EBUSY;
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  bool fail = drmModeAtomicAddProperty(pset, crtc->id(),
+                                       crtc->active_property().id(), 0) < 0 ||
+              drmModeAtomicAddProperty(pset, crtc->id(),
+                                       crtc->mode_property().id(), 0) < 0;
+
+  DrmConnector *conn = GetConnectorForDisplay(display);
+  if (conn && conn->encoder() && conn->encoder()->crtc() == crtc)
+    fail |= drmModeAtomicAddProperty(pset, conn->id(),
+                                     conn->crtc_id_property().id(), 0) < 0;
+
+  DrmConnector *writeback_conn = GetWritebackConnectorForDisplay(display);
+  if (writeback_conn)
+    fail |= drmModeAtomicAddProperty(pset, writeback_conn->id(),
+                                     writeback_conn->crtc_id_property().id(),
+                                     0) < 0;
+
+  if (fail) {
+    ALOGE("Failed to add properties to release crtc %d", crtc->id());
+    drmModeAtomicFree(pset);
+    return -EINVAL;
+  }
+
+  int ret;
+  {
+    DrmIoctlWatchdog::Scope scope(&watchdog_, DrmIoctlWatchdog::kAtomicCommit);
+    ret = drmModeAtomicCommit(fd(), pset, DRM_MODE_ATOMIC_ALLOW_MODESET,
+                              this);
+  }
+  drmModeAtomicFree(pset);
+  if (ret) {
+    ALOGE("Failed to release crtc %d for display %d %d", crtc->id(), display,
+          ret);
+    return ret;
+  }
+
+  if (conn && conn->encoder() && conn->encoder()->crtc() == crtc)
+    conn->encoder()->set_crtc(NULL);
+  if (writeback_conn) {
+    writeback_conn->encoder()->set_crtc(NULL);
+    writeback_conn->set_display(-1);
+  }
+  crtc->set_display(-1);
+  return 0;
+}
+
+int DrmDevice::ReserveLease(int display) {
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  DrmConnector *conn = GetConnectorForDisplay(display);
+  if (!conn) {
+    ALOGE("No connector to lease for display %d", display);
+    return -ENODEV;
+  }
+  if (reserved_leases_.count(display))
+    return -EBUSY;
+
+  int ret = BindDisplayPipeLocked(conn);
+  if (ret) {
+    ALOGE("No CRTC to lease for display %d %d", display, ret);
+    return ret;
+  }
+  DrmCrtc *crtc = GetCrtcForDisplay(display);
+
+  Lease lease = {.crtc = crtc, .planes = {}};
+  for (auto &plane : planes_) {
+    if (plane->leased() || !plane->GetCrtcSupported(*crtc))
+      continue;
+    // Planes another display can composite on are part of its pipe, taking
+    // them would pull them from under its frames.
+    bool shared = std::any_of(crtcs_.begin(), crtcs_.end(),
+                              [&](const std::unique_ptr<DrmCrtc> &other) {
+                                return other.get() != crtc &&
+                                       other->display() >= 0 &&
+                                       !other->leased() &&
+                                       plane->GetCrtcSupported(*other);
+                              });
+    if (!shared)
+      lease.planes.push_back(plane.get());
+  }
+
+  crtc->set_leased(true);
+  for (DrmPlane *plane : lease.planes)
+    plane->set_leased(true);
+  reserved_leases_[display] = lease;
+  return 0;
+}
+
+int DrmDevice::CreateLease(int display, uint32_t *lessee_id) {
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  DrmConnector *conn = GetConnectorForDisplay(display);
+  auto it = reserved_leases_.find(display);
+  if (!conn || it == reserved_leases_.end())
+    return -ENODEV;
+
+  const Lease &lease = it->second;
+  std::vector<uint32_t> objects = {conn->id(), lease.crtc->id()};
+  for (DrmPlane *plane : lease.planes)
+    objects.push_back(plane->id());
+
+  int lease_fd = drmModeCreateLease(fd_.get(), objects.data(), objects.size(),
+                                    O_CLOEXEC, lessee_id);
+  if (lease_fd < 0) {
+    ALOGE("Failed to lease display %d %d", display, lease_fd);
+    return lease_fd;
+  }
+
+  ALOGI("Leased display %d with %zu planes to lessee %u", display,
+        lease.planes.size(), *lessee_id);
+  leases_[*lessee_id] = lease;
+  reserved_leases_.erase(it);
+  return lease_fd;
+}
+
+void DrmDevice::CancelLease(int display) {
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  auto it = reserved_leases_.find(display);
+  if (it == reserved_leases_.end())
+    return;
+  it->second.crtc->set_leased(false);
+  for (DrmPlane *plane : it->second.planes)
+    plane->set_leased(false);
+  reserved_leases_.erase(it);
+}
+
+int DrmDevice::RevokeLease(uint32_t lessee_id) {
+  std::lock_guard<std::mutex> lk(pipe_lock_);
+  auto it = leases_.find(lessee_id);
+  if (it == leases_.end())
+    return -ENOENT;
+
+  // The lessee may be gone already, the objects are ours again either way
+  int ret = drmModeRevokeLease(fd_.get(), lessee_id);
+  if (ret && ret != -ENOENT)
+    ALOGW("Failed to revoke lease %u %d", lessee_id, ret);
+
+  it->second.crtc->set_leased(false);
+  for (DrmPlane *plane : it->second.planes)
+    plane->set_leased(false);
+  leases_.erase(it);
+  return 0;
+}
+
 int DrmDevice::CreatePropertyBlob(void *data, size_t length,
                                   uint32_t *blob_id) {
   struct drm_mode_create_blob create_blob;
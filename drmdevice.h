@@ -21,10 +21,14 @@
 #include "drmcrtc.h"
 #include "drmencoder.h"
 #include "drmeventlistener.h"
+#include "drmioctlwatchdog.h"
 #include "drmplane.h"
 #include "platform.h"
 
 #include <stdint.h>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <tuple>
 
 namespace android {
@@ -58,10 +62,26 @@ class DrmDevice {
 
   DrmConnector *GetConnectorForDisplay(int display) const;
   DrmConnector *GetWritebackConnectorForDisplay(int display) const;
-  DrmConnector *AvailableWritebackConnector(int display) const;
+  DrmConnector *AvailableWritebackConnector(int display);
   DrmCrtc *GetCrtcForDisplay(int display) const;
   DrmPlane *GetPlane(uint32_t id) const;
   DrmEventListener *event_listener();
+  DrmIoctlWatchdog *watchdog() {
+    return &watchdog_;
+  }
+
+  // Set with hwc.drm.headless on cloud instances and CI, where the device is
+  // a virtual one like vkms and there's no one looking at the display.
+  bool headless() const {
+    return headless_;
+  }
+  // Cleared with hwc.drm.headless.scanout=0, frames then only go through
+  // atomic tests and are never shown.
+  bool scanout() const {
+    return scanout_;
+  }
+  // Whether the mode is the first one hwc.drm.headless.mode asks for
+  bool IsHeadlessMode(const DrmMode &mode) const;
 
   int GetPlaneProperty(const DrmPlane &plane, const char *prop_name,
                        DrmProperty *property);
@@ -76,31 +96,83 @@ class DrmDevice {
   int CreatePropertyBlob(void *data, size_t length, uint32_t *blob_id);
   int DestroyPropertyBlob(uint32_t blob_id);
   bool HandlesDisplay(int display) const;
-  void RegisterHotplugHandler(DrmEventHandler *handler) {
+
+  bool LookupModeCache(uint64_t edid_hash, DrmModeCacheEntry *entry);
+  void UpdateModeCache(uint64_t edid_hash, const DrmModeCacheEntry &entry);
+
+  // Binds an encoder and CRTC to the connector's display, taking them back
+  // from disconnected displays if none are free. Released again once the
+  // connector is unplugged so another one can use them.
+  int BindDisplayPipe(DrmConnector *connector);
+  int ReleaseDisplayPipe(DrmConnector *connector);
+
+  // Leases the display's connector along with its CRTC and the planes that
+  // can be used on it to another DRM master, which drives them with its own
+  // commits. ReserveLease() marks them leased so the display stops using
+  // them, CreateLease() then returns the lessee's DRM fd or a negative error.
+  // CancelLease() gives back a reservation that wasn't leased.
+  int ReserveLease(int display);
+  int CreateLease(int display, uint32_t *lessee_id);
+  void CancelLease(int display);
+  int RevokeLease(uint32_t lessee_id);
+
+  void RegisterHotplugHandler(DrmHotplugEventHandler *handler) {
     event_listener_.RegisterHotplugHandler(handler);
   }
 
  private:
+  struct HeadlessMode {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    float refresh = 0.0f;
+  };
+
+  static DrmMode CreateSyntheticMode(const HeadlessMode &headless_mode);
   int TryEncoderForDisplay(int display, DrmEncoder *enc);
   int GetProperty(uint32_t obj_id, uint32_t obj_type, const char *prop_name,
                   DrmProperty *property);
 
   int CreateDisplayPipe(DrmConnector *connector);
-  int AttachWriteback(DrmConnector *display_conn);
+  int AttachWriteback(DrmCrtc *display_crtc);
+  int BindDisplayPipeLocked(DrmConnector *connector);
+  int ReleaseDisplayPipeLocked(int display);
 
   UniqueFd fd_;
   uint32_t mode_id_ = 0;
 
+  bool headless_ = false;
+  bool scanout_ = true;
+  std::vector<HeadlessMode> headless_modes_;
+
   std::vector<std::unique_ptr<DrmConnector>> connectors_;
   std::vector<std::unique_ptr<DrmConnector>> writeback_connectors_;
   std::vector<std::unique_ptr<DrmEncoder>> encoders_;
   std::vector<std::unique_ptr<DrmCrtc>> crtcs_;
   std::vector<std::unique_ptr<DrmPlane>> planes_;
   DrmEventListener event_listener_;
+  DrmIoctlWatchdog watchdog_;
 
   std::pair<uint32_t, uint32_t> min_resolution_;
   std::pair<uint32_t, uint32_t> max_resolution_;
   std::map<int, int> displays_;
+
+  // Serializes changes to which display the CRTCs, encoders and writeback
+  // connectors are bound to.
+  std::mutex pipe_lock_;
+
+  struct Lease {
+    DrmCrtc *crtc;
+    std::vector<DrmPlane *> planes;
+  };
+  std::map<uint32_t, Lease> leases_;
+  // By display, until they're leased or cancelled
+  std::map<int, Lease> reserved_leases_;
+
+  // Modes of the monitors seen on this device, by EDID hash
+  static const size_t kMaxModeCacheEntries = 16;
+  std::mutex mode_cache_lock_;
+  std::map<uint64_t, DrmModeCacheEntry> mode_cache_;
+  std::deque<uint64_t> mode_cache_order_;
 };
 }  // namespace android
 
@@ -21,6 +21,7 @@
 #include "drmhwcomposer.h"
 #include "drmplane.h"
 
+#include <memory>
 #include <sstream>
 #include <vector>
 
@@ -171,6 +172,23 @@ class DrmDisplayComposition {
     out_fence_.Set(out_fence);
   }
 
+  // Point on the CRTC's timeline that's signaled once the frame is shown,
+  // 0 if the frame's out fence comes from OUT_FENCE_PTR.
+  uint32_t timeline_point() const {
+    return timeline_point_;
+  }
+  void set_timeline_point(uint32_t point) {
+    timeline_point_ = point;
+  }
+
+  // Buffer the frame is written back to once it's committed, if any
+  DrmHwcLayer *readback() const {
+    return readback_.get();
+  }
+  void set_readback(std::unique_ptr<DrmHwcLayer> readback) {
+    readback_ = std::move(readback);
+  }
+
   void Dump(std::ostringstream *out) const;
 
  private:
@@ -186,6 +204,8 @@ class DrmDisplayComposition {
   DrmMode display_mode_;
 
   UniqueFd out_fence_ = -1;
+  uint32_t timeline_point_ = 0;
+  std::unique_ptr<DrmHwcLayer> readback_;
 
   bool geometry_changed_;
   std::vector<DrmHwcLayer> layers_;
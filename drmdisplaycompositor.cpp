@@ -22,10 +22,14 @@
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <xf86drm.h>
 #include <sstream>
 #include <vector>
 
+#include <cutils/properties.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
 #include <log/log.h>
 #include <sync/sync.h>
@@ -34,12 +38,66 @@
 #include "autolock.h"
 #include "drmcrtc.h"
 #include "drmdevice.h"
+#include "drmeventlistener.h"
 #include "drmplane.h"
 
 static const uint32_t kWaitWritebackFence = 100;  // ms
 
+// Async flips are given up on for good once the driver refused this many
+// in a row.
+static const int kMaxAsyncFlipFailures = 3;
+
 namespace android {
 
+static uint64_t DrmRotation(uint32_t transform) {
+  uint64_t rotation = 0;
+  if (transform & DrmHwcTransform::kFlipH)
+    rotation |= DRM_MODE_REFLECT_X;
+  if (transform & DrmHwcTransform::kFlipV)
+    rotation |= DRM_MODE_REFLECT_Y;
+  if (transform & DrmHwcTransform::kRotate90)
+    rotation |= DRM_MODE_ROTATE_90;
+  else if (transform & DrmHwcTransform::kRotate180)
+    rotation |= DRM_MODE_ROTATE_180;
+  else if (transform & DrmHwcTransform::kRotate270)
+    rotation |= DRM_MODE_ROTATE_270;
+  else
+    rotation |= DRM_MODE_ROTATE_0;
+  return rotation;
+}
+
+static bool IsYuvFormat(uint32_t format) {
+  switch (format) {
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_NV21:
+    case DRM_FORMAT_NV16:
+    case DRM_FORMAT_NV61:
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+    case DRM_FORMAT_YUYV:
+    case DRM_FORMAT_YVYU:
+    case DRM_FORMAT_UYVY:
+    case DRM_FORMAT_VYUY:
+    case DRM_FORMAT_P010:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static const char *FailureFeatureName(int feature) {
+  static const char *names[] = {"scaling", "rotation", "modifier", "yuv",
+                                "in_fence", "modeset", "writeback"};
+  return names[feature];
+}
+
+static std::string FourccToString(uint32_t format) {
+  std::string str;
+  for (int i = 0; i < 4; ++i)
+    str += (char)((format >> (8 * i)) & 0xff);
+  return str;
+}
+
 class CompositorVsyncCallback : public VsyncCallback {
  public:
   CompositorVsyncCallback(DrmDisplayCompositor *compositor)
@@ -54,16 +112,67 @@ class CompositorVsyncCallback : public VsyncCallback {
   DrmDisplayCompositor *compositor_;
 };
 
+// Signals the point of a frame on its CRTC's timeline once it's flipped
+class TimelineFlipHandler : public DrmEventHandler {
+ public:
+  TimelineFlipHandler(SyncTimeline *timeline, uint32_t point)
+      : timeline_(timeline), point_(point) {
+  }
+
+  void HandleEvent(uint64_t /* timestamp_us */) override {
+    timeline_->Signal(point_);
+  }
+
+ private:
+  SyncTimeline *timeline_;
+  uint32_t point_;
+};
+
+static SyncTimeline *GetTimeline(DrmDisplayComposition *comp) {
+  if (!comp->timeline_point() || !comp->crtc())
+    return NULL;
+  return comp->crtc()->timeline();
+}
+
+// For frames that are shown without a page flip event, or never
+static void SignalTimelinePoint(DrmDisplayComposition *comp) {
+  SyncTimeline *timeline = GetTimeline(comp);
+  if (timeline)
+    timeline->Signal(comp->timeline_point());
+}
+
 DrmDisplayCompositor::DrmDisplayCompositor()
     : resource_manager_(NULL),
       display_(-1),
       initialized_(false),
       active_(false),
       use_hw_overlays_(true),
+      scanout_(true),
+      writeback_yuv_(false),
       dump_frames_composited_(0),
       dump_last_timestamp_ns_(0),
+      dump_commit_ns_(0),
       flatten_countdown_(FLATTEN_COUNTDOWN_INIT),
-      writeback_fence_(-1) {
+      writeback_fence_(-1),
+      fenced_frames_(0),
+      dropped_timeline_(NULL),
+      dropped_point_(0),
+      async_flip_enabled_(false),
+      async_flip_consecutive_failures_(0),
+      async_flips_(0),
+      async_flip_fallbacks_(0),
+      front_buffer_enabled_(false),
+      damage_committed_(false),
+      damage_commits_(0),
+      sideband_flips_(0),
+      readback_frame_no_(-1),
+      readback_status_(0),
+      commits_in_flight_(0),
+      test_failures_(0),
+      commit_failures_(0) {
+  for (int i = 0; i < kNumFailureFeatures; ++i)
+    failures_by_feature_[i] = 0;
+
   struct timespec ts;
   if (clock_gettime(CLOCK_MONOTONIC, &ts))
     return;
@@ -75,7 +184,10 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     return;
 
   vsync_worker_.Exit();
-  int ret = pthread_mutex_lock(&lock_);
+  fence_worker_.Exit();
+  sideband_worker_.Exit();
+  histogram_worker_.Exit();
+  int ret = pthread_mutex_lock(&commit_lock_);
   if (ret)
     ALOGE("Failed to acquire compositor lock %d", ret);
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
@@ -86,10 +198,11 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
 
   active_composition_.reset();
 
-  ret = pthread_mutex_unlock(&lock_);
+  ret = pthread_mutex_unlock(&commit_lock_);
   if (ret)
     ALOGE("Failed to acquire compositor lock %d", ret);
 
+  pthread_mutex_destroy(&commit_lock_);
   pthread_mutex_destroy(&lock_);
 }
 
@@ -106,12 +219,74 @@ int DrmDisplayCompositor::Init(ResourceManager *resource_manager, int display) {
     ALOGE("Failed to initialize drm compositor lock %d\n", ret);
     return ret;
   }
+  ret = pthread_mutex_init(&commit_lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize drm compositor commit lock %d\n", ret);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
   planner_ = Planner::CreateInstance(drm);
+  scanout_ = drm->scanout();
+
+  char writeback_format_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.writeback_format", writeback_format_prop, "rgb888");
+  writeback_yuv_ = !strcmp(writeback_format_prop, "nv12");
+
+  char async_flip_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.async_flip", async_flip_prop, "0");
+  if (atoi(async_flip_prop)) {
+    uint64_t cap = 0;
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+    drmGetCap(drm->fd(), DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+#endif
+    async_flip_enabled_ = cap != 0;
+    if (!async_flip_enabled_)
+      ALOGI("Atomic async page flips unsupported on display %d", display);
+  }
+
+  char front_buffer_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.front_buffer", front_buffer_prop, "0");
+  front_buffer_enabled_ = atoi(front_buffer_prop);
+
+  std::string prefix = "HWC display " + std::to_string(display) + " ";
+  trace_names_.device_layers = prefix + "device layers";
+  trace_names_.client_layers = prefix + "client layers";
+  trace_names_.planes = prefix + "planes in use";
+  trace_names_.flattened = prefix + "flattened";
+  trace_names_.commit_latency = prefix + "commit latency us";
+  trace_names_.commits_in_flight = prefix + "commits in flight";
+  trace_names_.frame = prefix + "frame";
 
   vsync_worker_.Init(drm, display_);
   auto callback = std::make_shared<CompositorVsyncCallback>(this);
   vsync_worker_.RegisterCallback(callback);
 
+  // Optional, acquire fences are merged into sync_files without it
+  char syncobj_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.syncobj_fences", syncobj_prop, "1");
+  if (atoi(syncobj_prop) && acquire_timeline_.Init(drm))
+    ALOGI("No syncobj timelines on display %d", display);
+
+  ret = fence_worker_.Init(this, display_,
+                           acquire_timeline_.initialized() ? &acquire_timeline_
+                                                           : NULL);
+  if (ret) {
+    ALOGE("Failed to initialize fence worker %d", ret);
+    return ret;
+  }
+
+  ret = sideband_worker_.Init(this, display_);
+  if (ret) {
+    ALOGE("Failed to initialize sideband worker %d", ret);
+    return ret;
+  }
+
+  ret = histogram_worker_.Init(display_);
+  if (ret) {
+    ALOGE("Failed to initialize histogram worker %d", ret);
+    return ret;
+  }
+
   initialized_ = true;
   return 0;
 }
@@ -180,7 +355,11 @@ int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
     }
   }
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  {
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  }
   if (ret) {
     ALOGE("Failed to commit pset ret=%d\n", ret);
     drmModeAtomicFree(pset);
@@ -205,6 +384,16 @@ int DrmDisplayCompositor::SetupWritebackCommit(drmModeAtomicReqPtr pset,
     ALOGE("Invalid writeback buffer");
     return -EINVAL;
   }
+  // Buffers may be written in a format other than the one they're imported
+  // as, see DrmConnector::GetWritebackFormat()
+  uint32_t format = writeback_conn->GetWritebackFormat(
+      (*writeback_buffer)->format);
+  if (format) {
+    ret = writeback_buffer->ReinterpretFormat(
+        resource_manager_->GetDrmDevice(display_)->fd(), format);
+    if (ret)
+      return ret;
+  }
   ret = drmModeAtomicAddProperty(pset, writeback_conn->id(),
                                  writeback_conn->writeback_fb_id().id(),
                                  (*writeback_buffer)->fb_id);
@@ -230,6 +419,51 @@ int DrmDisplayCompositor::SetupWritebackCommit(drmModeAtomicReqPtr pset,
   return 0;
 }
 
+int DrmDisplayCompositor::WaitAcquireFence(int fence_fd) {
+  ATRACE_CALL();
+  for (int i = 0; fence_fd >= 0 && i < kAcquireWaitTries; ++i) {
+    int ret = sync_wait(fence_fd, kAcquireWaitTimeoutMs);
+    if (!ret)
+      return 0;
+    if (i == kAcquireWaitTries - 1) {
+      ALOGE("Acquire fence %d never signaled %d", fence_fd, ret);
+      return ret;
+    }
+    ALOGW("Acquire fence %d not signaled after %dms", fence_fd,
+          (i + 1) * kAcquireWaitTimeoutMs);
+  }
+  return 0;
+}
+
+bool DrmDisplayCompositor::MergeUserspaceFences(
+    DrmDisplayComposition *display_comp, UniqueFd *fence, uint64_t *point) {
+  bool found = false;
+  for (DrmCompositionPlane &comp_plane : display_comp->composition_planes()) {
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable ||
+        comp_plane.plane()->in_fence_fd_property().id() ||
+        comp_plane.source_layers().size() != 1 ||
+        comp_plane.source_layers().front() >= display_comp->layers().size())
+      continue;
+
+    DrmHwcLayer &layer = display_comp->layers()[comp_plane.source_layers()
+                                                    .front()];
+    int fence_fd = layer.acquire_fence.get();
+    if (fence_fd < 0)
+      continue;
+    found = true;
+    if (acquire_timeline_.initialized() &&
+        !acquire_timeline_.Import(fence_fd, point))
+      continue;
+    if (fence->get() < 0) {
+      fence->Set(dup(fence_fd));
+    } else {
+      int old_fence = fence->get();
+      fence->Set(sync_merge("hwc_acquire", old_fence, fence_fd));
+    }
+  }
+  return found;
+}
+
 int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
                                       bool test_only,
                                       DrmConnector *writeback_conn,
@@ -237,6 +471,46 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
   ATRACE_CALL();
 
   int ret = 0;
+  // Frames that are never shown are still checked by the kernel, it's the
+  // closest there is to showing them.
+  bool dry_run = !test_only && !scanout_;
+
+  DrmIoctlWatchdog::FrameContext watchdog_context(display_,
+                                                  display_comp->frame_no());
+
+  // Frames still on their way when the CRTC was leased belong to the lessee's
+  // screen no more, see ClearForLease()
+  if (display_comp->crtc() && display_comp->crtc()->leased())
+    return -EBUSY;
+
+  // When the buffers on screen are being drawn into, there's nothing to flip
+  // and the damage is all the driver needs to know about.
+  if (!test_only)
+    damage_committed_ = false;
+  if (!test_only && !dry_run && !writeback_buffer &&
+      IsDamageOnly(display_comp)) {
+    ret = CommitDamage(display_comp);
+    if (!ret) {
+      damage_committed_ = true;
+      SignalTimelinePoint(display_comp);
+      return 0;
+    }
+  }
+
+  // A frame that only swaps the buffer of a fullscreen layer may be flipped
+  // right away, anything the driver refuses goes through the regular commit.
+  if (!test_only && !dry_run && !writeback_buffer &&
+      CanAsyncFlip(display_comp)) {
+    ret = AsyncFlip(display_comp);
+    if (!ret)
+      return 0;
+    ++async_flip_fallbacks_;
+    if (++async_flip_consecutive_failures_ >= kMaxAsyncFlipFailures) {
+      ALOGW("Disabling async flips on display %d after %d failures", display_,
+            async_flip_consecutive_failures_);
+      async_flip_enabled_ = false;
+    }
+  }
 
   std::vector<DrmHwcLayer> &layers = display_comp->layers();
   std::vector<DrmCompositionPlane> &comp_planes = display_comp
@@ -273,7 +547,7 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       return ret;
     }
   }
-  if (crtc->out_fence_ptr_property().id() != 0) {
+  if (crtc->out_fence_ptr_property().id() != 0 && !dry_run) {
     ret = drmModeAtomicAddProperty(pset, crtc->id(),
                                    crtc->out_fence_ptr_property().id(),
                                    (uint64_t)&out_fences[crtc->pipe()]);
@@ -376,26 +650,16 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
         }
       }
 
-      rotation = 0;
-      if (layer.transform & DrmHwcTransform::kFlipH)
-        rotation |= DRM_MODE_REFLECT_X;
-      if (layer.transform & DrmHwcTransform::kFlipV)
-        rotation |= DRM_MODE_REFLECT_Y;
-      if (layer.transform & DrmHwcTransform::kRotate90)
-        rotation |= DRM_MODE_ROTATE_90;
-      else if (layer.transform & DrmHwcTransform::kRotate180)
-        rotation |= DRM_MODE_ROTATE_180;
-      else if (layer.transform & DrmHwcTransform::kRotate270)
-        rotation |= DRM_MODE_ROTATE_270;
-      else
-        rotation |= DRM_MODE_ROTATE_0;
-
-      if (fence_fd >= 0) {
-        int prop_id = plane->in_fence_fd_property().id();
-        if (prop_id == 0) {
-          ALOGE("Failed to get IN_FENCE_FD property id");
+      rotation = DrmRotation(layer.transform);
+
+      int prop_id = plane->in_fence_fd_property().id();
+      if (fence_fd >= 0 && prop_id == 0 && !test_only && !dry_run) {
+        // Frames go through fence_worker_ first, this only blocks for
+        // flattened scenes
+        ret = WaitAcquireFence(fence_fd);
+        if (ret)
           break;
-        }
+      } else if (fence_fd >= 0 && prop_id) {
         ret = drmModeAtomicAddProperty(pset, plane->id(), prop_id, fence_fd);
         if (ret < 0) {
           ALOGE("Failed to add IN_FENCE_FD property to pset: %d", ret);
@@ -488,13 +752,37 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
 
   if (!ret) {
     uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
-    if (test_only)
+    if (test_only || dry_run)
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
 
-    ret = drmModeAtomicCommit(drm->fd(), pset, flags, drm);
+    // The flip handler is deleted by the event listener once it's run
+    SyncTimeline *timeline = GetTimeline(display_comp);
+    TimelineFlipHandler *flip_handler = NULL;
+    if (!test_only && !dry_run && timeline) {
+      flip_handler = new TimelineFlipHandler(timeline,
+                                             display_comp->timeline_point());
+      flags |= DRM_MODE_PAGE_FLIP_EVENT;
+    }
+
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    if (test_only) {
+      ret = drmModeAtomicCommit(drm->fd(), pset, flags, drm);
+    } else {
+      ATRACE_INT(trace_names_.commits_in_flight.c_str(), ++commits_in_flight_);
+      int64_t start_ns = GetMonotonicNs();
+      ret = drmModeAtomicCommit(drm->fd(), pset, flags,
+                                flip_handler ? (void *)flip_handler : drm);
+      ATRACE_INT(trace_names_.commit_latency.c_str(),
+                 (GetMonotonicNs() - start_ns) / 1000);
+      ATRACE_INT(trace_names_.commits_in_flight.c_str(), --commits_in_flight_);
+    }
     if (ret) {
+      delete flip_handler;
       if (!test_only)
         ALOGE("Failed to commit pset ret=%d\n", ret);
+      RecordCommitFailure(display_comp, ret, test_only,
+                          writeback_buffer != NULL);
       drmModeAtomicFree(pset);
       return ret;
     }
@@ -502,6 +790,14 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
   if (pset)
     drmModeAtomicFree(pset);
 
+  // The mode is never set, so it's checked along with every frame
+  if (dry_run) {
+    if (mode_.needs_modeset)
+      connector->set_active_mode(mode_.mode);
+    SignalTimelinePoint(display_comp);
+    return 0;
+  }
+
   if (!test_only && mode_.needs_modeset) {
     ret = drm->DestroyPropertyBlob(mode_.old_blob_id);
     if (ret) {
@@ -530,6 +826,484 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
   return ret;
 }
 
+// Returns the damage of the layer as clip rects, all of the buffer if the
+// damage is unknown.
+static std::vector<drm_mode_rect> GetDamageClips(const DrmHwcLayer &layer,
+                                                 bool *full) {
+  std::vector<drm_mode_rect> clips;
+  *full = layer.damage.empty();
+  for (const hwc_rect_t &rect : layer.damage) {
+    if (rect.right <= rect.left || rect.bottom <= rect.top)
+      continue;
+    clips.push_back(
+        {.x1 = rect.left, .y1 = rect.top, .x2 = rect.right, .y2 = rect.bottom});
+  }
+  return clips;
+}
+
+// Whether two layers are shown the same way, regardless of their buffers
+static bool SameLayerState(const DrmHwcLayer &a, const DrmHwcLayer &b) {
+  return memcmp(&a.display_frame, &b.display_frame,
+                sizeof(a.display_frame)) == 0 &&
+         memcmp(&a.source_crop, &b.source_crop, sizeof(a.source_crop)) == 0 &&
+         a.transform == b.transform && a.alpha == b.alpha &&
+         a.blending == b.blending;
+}
+
+// Returns the only plane of the composition that shows a layer, or NULL if
+// there's none or more than one.
+static DrmCompositionPlane *GetSingleLayerPlane(DrmDisplayComposition *comp) {
+  DrmCompositionPlane *single = NULL;
+  for (DrmCompositionPlane &comp_plane : comp->composition_planes()) {
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable)
+      continue;
+    if (single || comp_plane.source_layers().size() != 1 ||
+        comp_plane.source_layers().front() >= comp->layers().size())
+      return NULL;
+    single = &comp_plane;
+  }
+  return single;
+}
+
+bool DrmDisplayCompositor::CanAsyncFlip(DrmDisplayComposition *display_comp) {
+  if (!async_flip_enabled_ || mode_.needs_modeset ||
+      display_comp->type() != DRM_COMPOSITION_TYPE_FRAME)
+    return false;
+
+  // A non-blocking flip has to hand back a retire fence of some kind
+  DrmCrtc *crtc = display_comp->crtc();
+  if (!crtc || (!crtc->out_fence_ptr_property().id() && !crtc->timeline()))
+    return false;
+
+  // Only the framebuffer may change in an async flip, so the previous frame
+  // must have shown a layer with the same geometry on the same plane.
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!active)
+    return false;
+  DrmCompositionPlane *cur_plane = GetSingleLayerPlane(display_comp);
+  DrmCompositionPlane *prev_plane = GetSingleLayerPlane(active.get());
+  if (!cur_plane || !prev_plane || cur_plane->plane() != prev_plane->plane())
+    return false;
+
+  DrmHwcLayer &cur = display_comp->layers()[cur_plane->source_layers().front()];
+  DrmHwcLayer &prev = active->layers()[prev_plane->source_layers().front()];
+  if (!cur.buffer || !prev.buffer)
+    return false;
+
+  // Not every kernel takes IN_FENCE_FD along with an async flip, and waiting
+  // here would hold up the caller. Buffers that aren't ready yet take the
+  // regular path.
+  if (cur.acquire_fence.get() >= 0 && sync_wait(cur.acquire_fence.get(), 0))
+    return false;
+
+  const hwc_rect_t &df = cur.display_frame;
+  if (df.left != 0 || df.top != 0 ||
+      df.right != (int)mode_.mode.h_display() ||
+      df.bottom != (int)mode_.mode.v_display())
+    return false;
+
+  return SameLayerState(cur, prev) &&
+         cur.buffer->format == prev.buffer->format &&
+         cur.buffer->modifiers[0] == prev.buffer->modifiers[0];
+}
+
+bool DrmDisplayCompositor::IsDamageOnly(DrmDisplayComposition *display_comp) {
+  if (!front_buffer_enabled_ || mode_.needs_modeset ||
+      display_comp->type() != DRM_COMPOSITION_TYPE_FRAME)
+    return false;
+
+  // Every plane must show the same buffer as in the previous frame, the same
+  // way, and the client must have said it renders to it in place. Static
+  // frames present the same buffers again too.
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!active ||
+      active->composition_planes().size() !=
+          display_comp->composition_planes().size())
+    return false;
+
+  bool damaged = false;
+  for (size_t i = 0; i < display_comp->composition_planes().size(); ++i) {
+    DrmCompositionPlane &cur_plane = display_comp->composition_planes()[i];
+    DrmCompositionPlane &prev_plane = active->composition_planes()[i];
+    if (cur_plane.plane() != prev_plane.plane() ||
+        cur_plane.type() != prev_plane.type() ||
+        cur_plane.source_layers() != prev_plane.source_layers())
+      return false;
+    if (cur_plane.type() == DrmCompositionPlane::Type::kDisable)
+      continue;
+    if (cur_plane.source_layers().size() != 1 ||
+        cur_plane.source_layers().front() >= display_comp->layers().size() ||
+        cur_plane.source_layers().front() >= active->layers().size())
+      return false;
+
+    size_t index = cur_plane.source_layers().front();
+    DrmHwcLayer &cur = display_comp->layers()[index];
+    DrmHwcLayer &prev = active->layers()[index];
+    if (!cur.front_buffer || !cur.sf_handle ||
+        cur.sf_handle != prev.sf_handle || !SameLayerState(cur, prev))
+      return false;
+    bool full;
+    damaged |= !GetDamageClips(cur, &full).empty() || full;
+  }
+  return damaged;
+}
+
+int DrmDisplayCompositor::CommitDamage(DrmDisplayComposition *display_comp) {
+  ATRACE_CALL();
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  // Every import makes a framebuffer of its own, the ones on screen are the
+  // active composition's and stay there.
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!active)
+    return -EINVAL;
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  int ret = 0;
+  int planes_damaged = 0;
+  std::vector<uint32_t> blob_ids;
+  for (DrmCompositionPlane &comp_plane : display_comp->composition_planes()) {
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable)
+      continue;
+    DrmPlane *plane = comp_plane.plane();
+    size_t index = comp_plane.source_layers().front();
+    DrmHwcLayer &layer = display_comp->layers()[index];
+    // Without damage clips the driver has nothing to be told about, the
+    // plane keeps scanning out the same buffer.
+    if (!plane->fb_damage_clips_property().id())
+      continue;
+
+    bool full;
+    std::vector<drm_mode_rect> clips = GetDamageClips(layer, &full);
+    if (clips.empty() && !full)
+      continue;
+
+    // No clips at all stands for damage to the whole buffer
+    uint32_t blob_id = 0;
+    if (!full) {
+      ret = drm->CreatePropertyBlob(clips.data(),
+                                    clips.size() * sizeof(drm_mode_rect),
+                                    &blob_id);
+      if (ret)
+        break;
+      blob_ids.push_back(blob_id);
+    }
+    ++planes_damaged;
+
+    // FB_ID of the buffer on screen is set again since drivers only look at
+    // the damage of planes that are part of the commit
+    ret = drmModeAtomicAddProperty(pset, plane->id(),
+                                   plane->fb_property().id(),
+                                   active->layers()[index].buffer->fb_id) <
+              0 ||
+          drmModeAtomicAddProperty(pset, plane->id(),
+                                   plane->fb_damage_clips_property().id(),
+                                   blob_id) < 0;
+    if (ret) {
+      ALOGE("Failed to add damage clips for plane %d", plane->id());
+      ret = -EINVAL;
+      break;
+    }
+  }
+
+  if (!ret && planes_damaged) {
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    // -EBUSY while the previous commit is pending falls back to a regular
+    // commit, which waits for it
+    ret = drmModeAtomicCommit(drm->fd(), pset, DRM_MODE_ATOMIC_NONBLOCK, drm);
+  }
+  drmModeAtomicFree(pset);
+  for (uint32_t blob_id : blob_ids)
+    drm->DestroyPropertyBlob(blob_id);
+
+  if (ret) {
+    ALOGV("Damage only commit on display %d failed %d", display_, ret);
+    return ret;
+  }
+  ++damage_commits_;
+  return 0;
+}
+
+int DrmDisplayCompositor::AsyncFlip(DrmDisplayComposition *display_comp) {
+  ATRACE_CALL();
+  DrmCompositionPlane *comp_plane = GetSingleLayerPlane(display_comp);
+  DrmPlane *plane = comp_plane->plane();
+  DrmCrtc *crtc = comp_plane->crtc();
+  DrmHwcLayer &layer = display_comp->layers()[comp_plane->source_layers()
+                                                  .front()];
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  int ret = drmModeAtomicAddProperty(pset, plane->id(),
+                                     plane->fb_property().id(),
+                                     layer.buffer->fb_id);
+  // The buffer that's replaced is released the same way as by a regular
+  // commit, by the out fence or by the flip event signaling the timeline.
+  uint64_t out_fence = 0;
+  if (ret >= 0 && crtc->out_fence_ptr_property().id())
+    ret = drmModeAtomicAddProperty(pset, crtc->id(),
+                                   crtc->out_fence_ptr_property().id(),
+                                   (uint64_t)&out_fence);
+  if (ret < 0) {
+    ALOGE("Failed to add plane %d fb to async flip", plane->id());
+    drmModeAtomicFree(pset);
+    return ret;
+  }
+
+  uint32_t flags = DRM_MODE_PAGE_FLIP_ASYNC;
+  SyncTimeline *timeline = GetTimeline(display_comp);
+  TimelineFlipHandler *flip_handler = NULL;
+  if (timeline) {
+    flip_handler = new TimelineFlipHandler(timeline,
+                                           display_comp->timeline_point());
+    flags |= DRM_MODE_PAGE_FLIP_EVENT;
+  }
+
+  {
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    ret = drmModeAtomicCommit(drm->fd(), pset, flags,
+                              flip_handler ? (void *)flip_handler : drm);
+  }
+  drmModeAtomicFree(pset);
+  if (ret) {
+    delete flip_handler;
+    ALOGV("Async flip on display %d refused %d", display_, ret);
+    RecordCommitFailure(display_comp, ret, false, false);
+    return ret;
+  }
+
+  if (crtc->out_fence_ptr_property().id())
+    display_comp->set_out_fence((int)out_fence);
+  async_flip_consecutive_failures_ = 0;
+  ++async_flips_;
+  return 0;
+}
+
+// Tells the sideband worker a flip is on screen and the next may be made
+class SidebandFlipHandler : public DrmEventHandler {
+ public:
+  SidebandFlipHandler(SidebandWorker *worker) : worker_(worker) {
+  }
+
+  void HandleEvent(uint64_t /* timestamp_us */) override {
+    worker_->FlipDone();
+  }
+
+ private:
+  SidebandWorker *worker_;
+};
+
+// Returns the plane a composition shows the sideband layer on, if any
+static DrmCompositionPlane *GetSidebandPlane(DrmDisplayComposition *comp) {
+  for (DrmCompositionPlane &comp_plane : comp->composition_planes()) {
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer ||
+        comp_plane.source_layers().size() != 1 ||
+        comp_plane.source_layers().front() >= comp->layers().size())
+      continue;
+    if (comp->layers()[comp_plane.source_layers().front()].sideband_frame)
+      return &comp_plane;
+  }
+  return NULL;
+}
+
+void DrmDisplayCompositor::OnSidebandFrame(
+    std::shared_ptr<const SidebandFrame> frame, int acquire_fence) {
+  ATRACE_CALL();
+  UniqueFd fence(acquire_fence);
+  {
+    std::lock_guard<std::mutex> lk(sideband_lock_);
+    sideband_frame_ = frame;
+    sideband_fence_.Set(fence.get() >= 0 ? dup(fence.get()) : -1);
+  }
+  sideband_worker_.Queue(std::move(frame), fence.Release());
+}
+
+int DrmDisplayCompositor::FlipSideband(
+    std::shared_ptr<const SidebandFrame> frame, int acquire_fence) {
+  ATRACE_CALL();
+  // Frames which arrive before a composition shows the stream are picked up
+  // by the next one, as are all of them when nothing is scanned out.
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!active || !scanout_)
+    return -EAGAIN;
+  DrmCompositionPlane *comp_plane = GetSidebandPlane(active.get());
+  if (!comp_plane)
+    return -EAGAIN;
+
+  // Whatever has to be waited on is, before the commit lock is taken
+  DrmPlane *plane = comp_plane->plane();
+  bool in_fence = acquire_fence >= 0 && plane->in_fence_fd_property().id();
+  if (!in_fence) {
+    int ret = WaitAcquireFence(acquire_fence);
+    if (ret)
+      return ret;
+  }
+
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  DrmHwcLayer layer;
+  layer.sf_handle = frame->buffer();
+  layer.sideband_frame = std::move(frame);
+  int ret = layer.ImportBuffer(resource_manager_->GetImporter(display_).get());
+  if (ret) {
+    ALOGE("Failed to import sideband frame %d", ret);
+    return ret;
+  }
+
+  AutoLock lock(&commit_lock_, __func__);
+  ret = lock.Lock();
+  if (ret)
+    return ret;
+  // The plane may have been given to another layer meanwhile
+  if (!active_ || std::atomic_load(&active_composition_) != active)
+    return -EAGAIN;
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  ret = drmModeAtomicAddProperty(pset, plane->id(), plane->fb_property().id(),
+                                 layer.buffer->fb_id) < 0;
+  if (in_fence)
+    ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                    plane->in_fence_fd_property().id(),
+                                    acquire_fence) < 0;
+  if (ret) {
+    ALOGE("Failed to add sideband frame to plane %d", plane->id());
+    drmModeAtomicFree(pset);
+    return -EINVAL;
+  }
+
+  // The flip handler is deleted by the event listener once it's run
+  SidebandFlipHandler *flip_handler = new SidebandFlipHandler(
+      &sideband_worker_);
+  {
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    ret = drmModeAtomicCommit(drm->fd(), pset,
+                              DRM_MODE_ATOMIC_NONBLOCK |
+                                  DRM_MODE_PAGE_FLIP_EVENT,
+                              flip_handler);
+  }
+  drmModeAtomicFree(pset);
+  if (ret) {
+    delete flip_handler;
+    return ret;
+  }
+
+  // The worker only flips once the last flip is done, the frame before it is
+  // off screen now and goes back to the producer. The new frame stays until
+  // the next flip or composition, and so does its framebuffer. A stream
+  // that's playing isn't worth flattening.
+  sideband_layer_ = std::move(sideband_pending_layer_);
+  sideband_pending_layer_ = std::move(layer);
+  flatten_countdown_ = FLATTEN_COUNTDOWN_INIT;
+  ++sideband_flips_;
+  return 0;
+}
+
+std::shared_ptr<const SidebandFrame> DrmDisplayCompositor::GetSidebandFrame(
+    UniqueFd *acquire_fence) {
+  std::lock_guard<std::mutex> lk(sideband_lock_);
+  if (sideband_fence_.get() >= 0)
+    acquire_fence->Set(dup(sideband_fence_.get()));
+  return sideband_frame_;
+}
+
+void DrmDisplayCompositor::ClearSidebandFrame() {
+  std::shared_ptr<const SidebandFrame> frame;
+  {
+    std::lock_guard<std::mutex> lk(sideband_lock_);
+    frame = std::move(sideband_frame_);
+    sideband_fence_.Close();
+  }
+  sideband_worker_.Clear();
+}
+
+void DrmDisplayCompositor::RecordCommitFailure(
+    DrmDisplayComposition *display_comp, int err, bool test_only,
+    bool writeback) {
+  CommitFailure failure;
+  failure.frame_no = display_comp->frame_no();
+  failure.err = err;
+  failure.test_only = test_only;
+  failure.features = 0;
+  if (mode_.needs_modeset)
+    failure.features |= 1 << kFailureModeset;
+  if (writeback)
+    failure.features |= 1 << kFailureWriteback;
+
+  std::vector<DrmHwcLayer> &layers = display_comp->layers();
+  for (DrmCompositionPlane &comp_plane : display_comp->composition_planes()) {
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable ||
+        comp_plane.source_layers().empty() ||
+        comp_plane.source_layers().front() >= layers.size())
+      continue;
+
+    DrmHwcLayer &layer = layers[comp_plane.source_layers().front()];
+    if (!layer.buffer)
+      continue;
+
+    CommitFailure::Plane plane;
+    plane.plane_id = comp_plane.plane()->id();
+    plane.format = layer.buffer->format;
+    plane.modifier = layer.buffer->modifiers[0];
+    float src_w = layer.source_crop.right - layer.source_crop.left;
+    float src_h = layer.source_crop.bottom - layer.source_crop.top;
+    plane.scale_x = src_w ? (layer.display_frame.right -
+                             layer.display_frame.left) /
+                                src_w
+                          : 0.0f;
+    plane.scale_y = src_h ? (layer.display_frame.bottom -
+                             layer.display_frame.top) /
+                                src_h
+                          : 0.0f;
+    plane.rotation = DrmRotation(layer.transform);
+
+    if (plane.scale_x != 1.0f || plane.scale_y != 1.0f)
+      failure.features |= 1 << kFailureScaling;
+    if (plane.rotation != DRM_MODE_ROTATE_0)
+      failure.features |= 1 << kFailureRotation;
+    if (plane.modifier != DRM_FORMAT_MOD_LINEAR)
+      failure.features |= 1 << kFailureModifier;
+    if (IsYuvFormat(plane.format))
+      failure.features |= 1 << kFailureYuv;
+    if (layer.acquire_fence.get() >= 0)
+      failure.features |= 1 << kFailureInFence;
+
+    failure.planes.emplace_back(plane);
+  }
+
+  std::lock_guard<std::mutex> lk(failure_lock_);
+  if (test_only)
+    ++test_failures_;
+  else
+    ++commit_failures_;
+  ++failures_by_errno_[err];
+  for (int i = 0; i < kNumFailureFeatures; ++i)
+    if (failure.features & (1 << i))
+      ++failures_by_feature_[i];
+
+  recent_failures_.emplace_back(std::move(failure));
+  if (recent_failures_.size() > kMaxCommitFailures)
+    recent_failures_.pop_front();
+}
+
 int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
   DrmConnector *conn = drm->GetConnectorForDisplay(display_);
@@ -567,50 +1341,176 @@ std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
 }
 
 void DrmDisplayCompositor::ClearDisplay() {
-  if (!active_composition_)
+  AutoLock lock(&commit_lock_, __func__);
+  if (lock.Lock())
+    return;
+  ClearDisplayLocked();
+}
+
+int DrmDisplayCompositor::ClearForLease(const std::function<int()> &reserve) {
+  AutoLock lock(&commit_lock_, __func__);
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  ret = reserve();
+  if (ret)
+    return ret;
+  leased_composition_ = std::atomic_load(&active_composition_);
+  ClearDisplayLocked();
+  return 0;
+}
+
+void DrmDisplayCompositor::FinishLease(bool leased) {
+  AutoLock lock(&commit_lock_, __func__);
+  if (lock.Lock())
+    return;
+  std::shared_ptr<DrmDisplayComposition> composition = std::move(
+      leased_composition_);
+  // A frame presented since then replaced it already
+  if (leased || !composition || std::atomic_load(&active_composition_))
+    return;
+  // Its buffers were kept alive along with it, and its fences signaled
+  if (CommitFrame(composition.get(), false)) {
+    ALOGE("Failed to restore display %d after a failed lease", display_);
+    return;
+  }
+  std::atomic_store(&active_composition_, composition);
+  vsync_worker_.VSyncControl(true);
+}
+
+void DrmDisplayCompositor::ClearDisplayLocked() {
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!active)
     return;
 
-  if (DisablePlanes(active_composition_.get()))
+  if (DisablePlanes(active.get()))
     return;
 
-  active_composition_.reset(NULL);
+  std::atomic_store(&active_composition_,
+                    std::shared_ptr<DrmDisplayComposition>());
+  sideband_layer_ = DrmHwcLayer();
+  sideband_pending_layer_ = DrmHwcLayer();
   vsync_worker_.VSyncControl(false);
 }
 
-void DrmDisplayCompositor::ApplyFrame(
+void DrmDisplayCompositor::ApplyFrameLocked(
     std::unique_ptr<DrmDisplayComposition> composition, int status,
-    bool writeback) {
-  AutoLock lock(&lock_, __func__);
-  if (lock.Lock())
-    return;
+    bool writeback, UniqueFd *out_fence) {
   int ret = status;
 
+  // The readback buffer may still be read from by its previous user
+  DrmHwcLayer *readback = composition->readback();
+  DrmConnector *readback_conn = NULL;
+  if (!ret && readback) {
+    readback_conn = GetReadbackConnector();
+    if (!readback_conn || WaitAcquireFence(readback->acquire_fence.get()))
+      readback = NULL;
+  }
+
+  // Content samples ride along on frames that aren't read back already.
+  // Flattened scenes don't change what's shown, the last sample still holds.
+  std::unique_ptr<DrmHwcLayer> sample;
+  sp<GraphicBuffer> sample_buffer;
+  if (!ret && !writeback && !composition->readback() &&
+      !mode_.needs_modeset &&
+      composition->type() == DRM_COMPOSITION_TYPE_FRAME &&
+      histogram_worker_.SampleDue()) {
+    sample = CreateSampleLayer(&readback_conn, &sample_buffer);
+    if (sample)
+      readback = sample.get();
+  }
+
   if (!ret) {
     if (writeback && !CountdownExpired()) {
       ALOGE("Abort playing back scene");
       return;
     }
-    ret = CommitFrame(composition.get(), false);
+    int64_t start_ns = GetMonotonicNs();
+    ret = CommitFrame(composition.get(), false, readback_conn,
+                      readback ? &readback->buffer : NULL);
+    // Sampling isn't worth dropping the frame over
+    if (ret && sample) {
+      ALOGW("Commit with content sample failed %d, retrying without", ret);
+      sample.reset();
+      readback = NULL;
+      ret = CommitFrame(composition.get(), false);
+    }
+    dump_commit_ns_ += GetMonotonicNs() - start_ns;
+  }
+
+  if (sample && !ret) {
+    histogram_worker_.QueueSample(std::move(sample), sample_buffer,
+                                  writeback_fence_, GetMonotonicNs());
+    writeback_fence_ = -1;
+  }
+
+  if (composition->readback()) {
+    std::lock_guard<std::mutex> lk(readback_lock_);
+    readback_frame_no_ = composition->frame_no();
+    readback_status_ = ret ? ret : readback ? 0 : -ENODEV;
+    readback_fence_.Set(readback && !ret ? writeback_fence_ : -1);
+    if (readback && !ret)
+      writeback_fence_ = -1;
+  }
+
+  // Flattened compositions aren't validated by SurfaceFlinger, so they don't
+  // have a slice of their own.
+  if (!writeback)
+    EndFrameSlice(composition->frame_no());
+
+  // This frame replaces any that was dropped before it, either on screen or
+  // by clearing the display. If it has a point on the same timeline, the
+  // page flip event signals both.
+  if (dropped_timeline_) {
+    if (ret || GetTimeline(composition.get()) != dropped_timeline_)
+      dropped_timeline_->Signal(dropped_point_);
+    dropped_timeline_ = NULL;
   }
 
   if (ret) {
+    SignalTimelinePoint(composition.get());
     ALOGE("Composite failed for display %d", display_);
     // Disable the hw used by the last active composition. This allows us to
     // signal the release fences from that composition to avoid hanging.
-    ClearDisplay();
+    ClearDisplayLocked();
     return;
   }
   ++dump_frames_composited_;
-
-  active_composition_.swap(composition);
+  if (out_fence && !composition->timeline_point())
+    out_fence->Set(composition->take_out_fence());
+
+  size_t planes_in_use = 0;
+  for (DrmCompositionPlane &comp_plane : composition->composition_planes())
+    if (comp_plane.type() != DrmCompositionPlane::Type::kDisable)
+      ++planes_in_use;
+  ATRACE_INT(trace_names_.planes.c_str(), planes_in_use);
+  ATRACE_INT(trace_names_.flattened.c_str(), writeback ? 1 : 0);
+
+  // After a damage only commit the active composition's framebuffers are
+  // still on screen, the ones imported for this frame were never shown.
+  if (!damage_committed_) {
+    std::atomic_store(&active_composition_,
+                      std::shared_ptr<DrmDisplayComposition>(
+                          std::move(composition)));
+    // The new composition brought its own import of the latest sideband
+    // frame
+    sideband_layer_ = DrmHwcLayer();
+    sideband_pending_layer_ = DrmHwcLayer();
+  }
 
   flatten_countdown_ = FLATTEN_COUNTDOWN_INIT;
   vsync_worker_.VSyncControl(!writeback);
 }
 
 int DrmDisplayCompositor::ApplyComposition(
-    std::unique_ptr<DrmDisplayComposition> composition) {
-  int ret = 0;
+    std::unique_ptr<DrmDisplayComposition> composition,
+    UniqueFd *retire_fence) {
+  AutoLock lock(&commit_lock_, __func__);
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
   switch (composition->type()) {
     case DRM_COMPOSITION_TYPE_FRAME:
       if (composition->geometry_changed()) {
@@ -623,10 +1523,52 @@ int DrmDisplayCompositor::ApplyComposition(
         }
       }
 
-      ApplyFrame(std::move(composition), ret);
+      {
+        // Frames with fences that have to be waited on in userspace, and any
+        // frame queued behind them, are committed by fence_worker_ instead
+        // of blocking the caller. The fences are collected either way, so
+        // nothing is left for the worker to wait on with commit_lock_ held.
+        UniqueFd fence;
+        uint64_t point = 0;
+        bool fenced = MergeUserspaceFences(composition.get(), &fence, &point);
+        fenced |= fence_worker_.Busy();
+
+        // Frames retire on the CRTC's timeline, at a point that's signaled
+        // by the page flip event of their commit, when the CRTC has no
+        // OUT_FENCE_PTR or the commit is left to fence_worker_.
+        DrmCrtc *crtc = composition->crtc();
+        SyncTimeline *timeline = crtc ? crtc->timeline() : NULL;
+        if (timeline && (fenced || !crtc->out_fence_ptr_property().id())) {
+          uint32_t timeline_point;
+          UniqueFd timeline_fence(timeline->CreateFence(&timeline_point));
+          if (timeline_fence.get() >= 0) {
+            composition->set_timeline_point(timeline_point);
+            if (retire_fence)
+              retire_fence->Set(timeline_fence.Release());
+          }
+        }
+
+        // Without a retire fence SurfaceFlinger would take the buffers on
+        // screen back before a queued frame replaced them. Such frames wait
+        // for their fences in place instead, when they're committed.
+        if (fenced && composition->timeline_point()) {
+          ++fenced_frames_;
+          fence_worker_.Queue(std::move(composition), fence.Release(), point);
+          return 0;
+        }
+      }
+
+      ApplyFrameLocked(std::move(composition), ret, false, retire_fence);
       break;
     case DRM_COMPOSITION_TYPE_DPMS:
       active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
+      if (!active_) {
+        // Nothing that's still waiting is going to be flipped
+        fence_worker_.Clear();
+        if (composition->crtc() && composition->crtc()->timeline())
+          composition->crtc()->timeline()->SignalAll();
+        dropped_timeline_ = NULL;
+      }
       ret = ApplyDpms(composition.get());
       if (ret)
         ALOGE("Failed to apply dpms for display %d", display_);
@@ -651,15 +1593,182 @@ int DrmDisplayCompositor::ApplyComposition(
   return ret;
 }
 
+void DrmDisplayCompositor::ApplyFencedComposition(
+    std::unique_ptr<DrmDisplayComposition> composition, int status) {
+  AutoLock lock(&commit_lock_, __func__);
+  if (lock.Lock())
+    return;
+  // The display may have been turned off while the frame was waiting, in
+  // which case every point was signaled already
+  if (!active_) {
+    EndFrameSlice(composition->frame_no());
+    SignalTimelinePoint(composition.get());
+    return;
+  }
+  // The retire fence of a dropped frame signals once a later frame replaced
+  // it on screen, not before.
+  if (status) {
+    EndFrameSlice(composition->frame_no());
+    SyncTimeline *timeline = GetTimeline(composition.get());
+    if (!timeline)
+      return;
+    if (dropped_timeline_ && dropped_timeline_ != timeline)
+      dropped_timeline_->Signal(dropped_point_);
+    dropped_timeline_ = timeline;
+    dropped_point_ = composition->timeline_point();
+    return;
+  }
+  ApplyFrameLocked(std::move(composition), 0);
+}
+
 int DrmDisplayCompositor::TestComposition(DrmDisplayComposition *composition) {
+  AutoLock lock(&commit_lock_, __func__);
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
   return CommitFrame(composition, true);
 }
 
+int DrmDisplayCompositor::TestPlaneScaling(DrmPlane *plane,
+                                           const DrmMode &mode, uint32_t width,
+                                           uint32_t height) {
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  DrmConnector *connector = drm->GetConnectorForDisplay(display_);
+  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
+  if (!connector || !crtc)
+    return -ENODEV;
+
+  sp<GraphicBuffer> buffer = new GraphicBuffer(width, height,
+                                               HAL_PIXEL_FORMAT_RGBX_8888,
+                                               GRALLOC_USAGE_HW_COMPOSER);
+  if (buffer->initCheck()) {
+    ALOGE("Failed to allocate %ux%u scaling test buffer", width, height);
+    return -ENOMEM;
+  }
+  DrmHwcLayer layer;
+  layer.sf_handle = buffer->handle;
+  int ret = layer.ImportBuffer(resource_manager_->GetImporter(display_).get());
+  if (ret) {
+    ALOGE("Failed to import scaling test buffer %d", ret);
+    return ret;
+  }
+
+  uint32_t blob_id = 0;
+  std::tie(ret, blob_id) = CreateModeBlob(mode);
+  if (ret)
+    return ret;
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    drm->DestroyPropertyBlob(blob_id);
+    return -ENOMEM;
+  }
+
+  // The mode is part of the test, the CRTC may not be showing it yet
+  ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->active_property().id(),
+                                 1) < 0;
+  ret |= drmModeAtomicAddProperty(pset, crtc->id(), crtc->mode_property().id(),
+                                  blob_id) < 0;
+  ret |= drmModeAtomicAddProperty(pset, connector->id(),
+                                  connector->crtc_id_property().id(),
+                                  crtc->id()) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->crtc_property().id(), crtc->id()) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(), plane->fb_property().id(),
+                                  layer.buffer->fb_id) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->crtc_x_property().id(), 0) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->crtc_y_property().id(), 0) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->crtc_w_property().id(),
+                                  mode.h_display()) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->crtc_h_property().id(),
+                                  mode.v_display()) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->src_x_property().id(), 0) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->src_y_property().id(), 0) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->src_w_property().id(),
+                                  width << 16) < 0;
+  ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                  plane->src_h_property().id(),
+                                  height << 16) < 0;
+  if (ret) {
+    ALOGE("Failed to add scaling test of plane %d to pset", plane->id());
+    ret = -EINVAL;
+  } else {
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    ret = drmModeAtomicCommit(drm->fd(), pset,
+                              DRM_MODE_ATOMIC_TEST_ONLY |
+                                  DRM_MODE_ATOMIC_ALLOW_MODESET,
+                              drm);
+  }
+
+  drmModeAtomicFree(pset);
+  drm->DestroyPropertyBlob(blob_id);
+  return ret;
+}
+
 // Flatten a scene on the display by using a writeback connector
 // and returns the composition result as a DrmHwcLayer.
+static DrmPlane *GetPrimaryPlane(DrmDevice *drm, DrmCrtc *crtc) {
+  for (auto &plane : drm->planes())
+    if (plane->type() == DRM_PLANE_TYPE_PRIMARY &&
+        plane->GetCrtcSupported(*crtc))
+      return plane.get();
+  return NULL;
+}
+
+int DrmDisplayCompositor::ChooseWritebackFormat(DrmConnector *writeback_conn,
+                                                DrmPlane *scanout_plane,
+                                                uint32_t *hal_format) {
+  // NV12 saves encoders a conversion, the RGB formats are what flattening
+  // has always used. BGRA_8888 is the one connectors that only list
+  // XRGB8888 are left with.
+  std::vector<uint32_t> candidates;
+  if (writeback_yuv_)
+    candidates.push_back(HAL_PIXEL_FORMAT_YCBCR_420_888);
+  candidates.push_back(HAL_PIXEL_FORMAT_RGB_888);
+  candidates.push_back(HAL_PIXEL_FORMAT_RGBX_8888);
+  candidates.push_back(HAL_PIXEL_FORMAT_BGRA_8888);
+
+  std::shared_ptr<Importer> importer = resource_manager_->GetImporter(
+      display_);
+  for (uint32_t candidate : candidates) {
+    uint32_t format = writeback_conn->GetWritebackFormat(
+        importer->ConvertHalFormatToDrm(candidate));
+    if (!format ||
+        (scanout_plane && !scanout_plane->IsFormatSupported(format)))
+      continue;
+    *hal_format = candidate;
+    return 0;
+  }
+  ALOGV("No usable writeback format on connector %d", writeback_conn->id());
+  return -EINVAL;
+}
+
+int DrmDisplayCompositor::CheckWritebackFormat(DrmConnector *writeback_conn,
+                                               uint32_t format) {
+  if (writeback_conn->GetWritebackFormat(format))
+    return 0;
+
+  ALOGE("Connector %d can't write back format 0x%x", writeback_conn->id(),
+        format);
+  if (format == DRM_FORMAT_NV12 || format == DRM_FORMAT_NV21) {
+    ALOGW("Falling back to RGB writeback on display %d", display_);
+    writeback_yuv_ = false;
+  }
+  return -EINVAL;
+}
+
 int DrmDisplayCompositor::FlattenOnDisplay(
     std::unique_ptr<DrmDisplayComposition> &src, DrmConnector *writeback_conn,
-    DrmMode &src_mode, DrmHwcLayer *writeback_layer) {
+    DrmMode &src_mode, DrmPlane *scanout_plane, DrmHwcLayer *writeback_layer) {
   int ret = 0;
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
   ret = writeback_conn->UpdateModes();
@@ -667,7 +1776,8 @@ int DrmDisplayCompositor::FlattenOnDisplay(
     ALOGE("Failed to update modes %d", ret);
     return ret;
   }
-  for (const DrmMode &mode : writeback_conn->modes()) {
+  std::shared_ptr<const DrmModeList> modes = writeback_conn->modes();
+  for (const DrmMode &mode : modes->modes) {
     if (mode.h_display() == src_mode.h_display() &&
         mode.v_display() == src_mode.v_display()) {
       mode_.mode = mode;
@@ -723,11 +1833,16 @@ int DrmDisplayCompositor::FlattenOnDisplay(
 
   AutoLock lock(&lock_, __func__);
   ret = lock.Lock();
+  if (ret)
+    return ret;
+  uint32_t writeback_format;
+  ret = ChooseWritebackFormat(writeback_conn, scanout_plane, &writeback_format);
   if (ret)
     return ret;
   DrmFramebuffer *writeback_fb = &framebuffers_[framebuffer_index_];
   framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
-  if (!writeback_fb->Allocate(mode_.mode.h_display(), mode_.mode.v_display())) {
+  if (!writeback_fb->Allocate(mode_.mode.h_display(), mode_.mode.v_display(),
+                              writeback_format)) {
     ALOGE("Failed to allocate writeback buffer");
     return -ENOMEM;
   }
@@ -739,6 +1854,9 @@ int DrmDisplayCompositor::FlattenOnDisplay(
     ALOGE("Failed to import writeback buffer");
     return ret;
   }
+  ret = CheckWritebackFormat(writeback_conn, (*writeback_buffer)->format);
+  if (ret)
+    return ret;
 
   ret = CommitFrame(src.get(), true, writeback_conn, writeback_buffer);
   if (ret) {
@@ -772,20 +1890,35 @@ int DrmDisplayCompositor::FlattenSerial(DrmConnector *writeback_conn) {
   if (!writeback_comp)
     return -EINVAL;
 
-  AutoLock lock(&lock_, __func__);
-  int ret = lock.Lock();
-  if (ret)
-    return ret;
-  if (!CountdownExpired() || active_composition_->layers().size() < 2) {
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!CountdownExpired() || !active || active->layers().size() < 2) {
     ALOGV("Flattening is not needed");
     return -EALREADY;
   }
 
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
+  if (!crtc) {
+    ALOGE("Failed to find crtc for display %d", display_);
+    return -EINVAL;
+  }
+  uint32_t writeback_format;
+  int ret = ChooseWritebackFormat(writeback_conn, GetPrimaryPlane(drm, crtc),
+                                  &writeback_format);
+  if (ret)
+    return ret;
+
+  AutoLock lock(&lock_, __func__);
+  ret = lock.Lock();
+  if (ret)
+    return ret;
   DrmFramebuffer *writeback_fb = &framebuffers_[framebuffer_index_];
   framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
   lock.Unlock();
 
-  if (!writeback_fb->Allocate(mode_.mode.h_display(), mode_.mode.v_display())) {
+  if (!writeback_fb->Allocate(mode_.mode.h_display(), mode_.mode.v_display(),
+                              writeback_format)) {
     ALOGE("Failed to allocate writeback buffer");
     return -ENOMEM;
   }
@@ -803,25 +1936,26 @@ int DrmDisplayCompositor::FlattenSerial(DrmConnector *writeback_conn) {
     ALOGE("Failed to import writeback buffer");
     return ret;
   }
+  ret = CheckWritebackFormat(writeback_conn, writeback_layer.buffer->format);
+  if (ret)
+    return ret;
 
   drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
   if (!pset) {
     ALOGE("Failed to allocate property set");
     return -ENOMEM;
   }
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
-  if (!crtc) {
-    ALOGE("Failed to find crtc for display %d", display_);
-    return -EINVAL;
-  }
   ret = SetupWritebackCommit(pset, crtc->id(), writeback_conn,
                              &writeback_layer.buffer);
   if (ret < 0) {
     ALOGE("Failed to Setup Writeback Commit");
     return ret;
   }
-  ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  {
+    DrmIoctlWatchdog::Scope scope(drm->watchdog(),
+                                  DrmIoctlWatchdog::kAtomicCommit);
+    ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  }
   if (ret) {
     ALOGE("Failed to enable writeback %d", ret);
     return ret;
@@ -851,7 +1985,7 @@ int DrmDisplayCompositor::FlattenSerial(DrmConnector *writeback_conn) {
     return ret;
   }
 
-  ApplyFrame(std::move(writeback_comp), 0, true);
+  ApplyFrameLocked(std::move(writeback_comp), 0, true);
   return 0;
 }
 
@@ -880,18 +2014,16 @@ int DrmDisplayCompositor::FlattenConcurrent(DrmConnector *writeback_conn) {
 
   if (!copy_comp || !writeback_comp)
     return -EINVAL;
-  AutoLock lock(&lock_, __func__);
-  ret = lock.Lock();
-  if (ret)
-    return ret;
-  if (!CountdownExpired() || active_composition_->layers().size() < 2) {
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if (!CountdownExpired() || !active || active->layers().size() < 2) {
     ALOGV("Flattening is not needed");
     return -EALREADY;
   }
-  DrmCrtc *crtc = active_composition_->crtc();
+  DrmCrtc *crtc = active->crtc();
 
   std::vector<DrmHwcLayer> copy_layers;
-  for (DrmHwcLayer &src_layer : active_composition_->layers()) {
+  for (DrmHwcLayer &src_layer : active->layers()) {
     DrmHwcLayer copy;
     ret = copy.InitFromDrmHwcLayer(&src_layer,
                                    resource_manager_
@@ -909,10 +2041,11 @@ int DrmDisplayCompositor::FlattenConcurrent(DrmConnector *writeback_conn) {
     return ret;
   }
 
-  lock.Unlock();
   DrmHwcLayer writeback_layer;
-  ret = drmdisplaycompositor.FlattenOnDisplay(copy_comp, writeback_conn,
-                                              mode_.mode, &writeback_layer);
+  ret = drmdisplaycompositor.FlattenOnDisplay(
+      copy_comp, writeback_conn, mode_.mode,
+      GetPrimaryPlane(resource_manager_->GetDrmDevice(display_), crtc),
+      &writeback_layer);
   if (ret) {
     ALOGE("Failed to flatten on display ret = %d", ret);
     return ret;
@@ -947,14 +2080,28 @@ int DrmDisplayCompositor::FlattenConcurrent(DrmConnector *writeback_conn) {
     ALOGE("Failed to add plane composition %d", ret);
     return ret;
   }
-  ApplyFrame(std::move(writeback_comp), 0, true);
+  ApplyFrameLocked(std::move(writeback_comp), 0, true);
   return ret;
 }
 
 int DrmDisplayCompositor::FlattenActiveComposition() {
+  // Flattening is opportunistic, so rather than waiting behind a commit
+  // leave it to the next vsync.
+  AutoLock lock(&commit_lock_, __func__);
+  int ret = lock.TryLock();
+  if (ret)
+    return ret;
+
+  // Flattening would take the sideband layer off its plane and freeze it,
+  // and writeback doesn't write anything without scanout
+  std::shared_ptr<DrmDisplayComposition> active = std::atomic_load(
+      &active_composition_);
+  if ((active && GetSidebandPlane(active.get())) || !scanout_)
+    return -EBUSY;
+
   DrmConnector *writeback_conn = resource_manager_->AvailableWritebackConnector(
       display_);
-  if (!active_composition_ || !writeback_conn) {
+  if (!active || !writeback_conn) {
     ALOGV("No writeback connector available");
     return -EINVAL;
   }
@@ -968,18 +2115,122 @@ int DrmDisplayCompositor::FlattenActiveComposition() {
   return 0;
 }
 
+DrmConnector *DrmDisplayCompositor::GetReadbackConnector() {
+  if (!scanout_)
+    return NULL;
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  DrmConnector *writeback_conn = drm->GetWritebackConnectorForDisplay(
+      display_);
+  DrmConnector *display_conn = drm->GetConnectorForDisplay(display_);
+  if (!writeback_conn || !display_conn ||
+      !writeback_conn->encoder()->CanClone(display_conn->encoder()))
+    return NULL;
+  return writeback_conn;
+}
+
+std::unique_ptr<DrmHwcLayer> DrmDisplayCompositor::CreateSampleLayer(
+    DrmConnector **readback_conn, sp<GraphicBuffer> *sample_buffer) {
+  DrmConnector *writeback_conn = GetReadbackConnector();
+  if (!writeback_conn)
+    return NULL;
+
+  // Histograms are computed from RGB, whatever flattening would pick.
+  // BGRA_8888 covers connectors that only write XRGB8888.
+  std::shared_ptr<Importer> importer = resource_manager_->GetImporter(
+      display_);
+  uint32_t format = 0;
+  for (uint32_t candidate :
+       {HAL_PIXEL_FORMAT_RGBX_8888, HAL_PIXEL_FORMAT_RGB_888,
+        HAL_PIXEL_FORMAT_BGRA_8888}) {
+    if (writeback_conn->GetWritebackFormat(
+            importer->ConvertHalFormatToDrm(candidate))) {
+      format = candidate;
+      break;
+    }
+  }
+  if (!format) {
+    ALOGV("No RGB writeback format for content sampling");
+    return NULL;
+  }
+
+  sp<GraphicBuffer> buffer = histogram_worker_.GetBuffer(
+      mode_.mode.h_display(), mode_.mode.v_display(), format);
+  if (buffer == NULL)
+    return NULL;
+  std::unique_ptr<DrmHwcLayer> layer(new DrmHwcLayer());
+  layer->sf_handle = buffer->handle;
+  if (layer->ImportBuffer(importer.get())) {
+    ALOGE("Failed to import content sample buffer");
+    return NULL;
+  }
+  *readback_conn = writeback_conn;
+  *sample_buffer = buffer;
+  return layer;
+}
+
+int DrmDisplayCompositor::SetContentSampling(uint32_t interval_ms) {
+  if (interval_ms && !GetReadbackConnector())
+    return -ENODEV;
+  histogram_worker_.SetInterval(interval_ms);
+  return 0;
+}
+
+bool DrmDisplayCompositor::GetContentSample(
+    int64_t *timestamp_ns, std::vector<uint32_t> *histograms) {
+  return histogram_worker_.GetSample(timestamp_ns, histograms);
+}
+
+int DrmDisplayCompositor::GetReadbackFormat(uint32_t *hal_format) {
+  DrmConnector *writeback_conn = GetReadbackConnector();
+  if (!writeback_conn)
+    return -ENODEV;
+  return ChooseWritebackFormat(writeback_conn, NULL, hal_format);
+}
+
+int DrmDisplayCompositor::GetReadbackFence(uint64_t frame_no,
+                                           UniqueFd *fence) {
+  std::lock_guard<std::mutex> lk(readback_lock_);
+  if (readback_frame_no_ < 0 || (uint64_t)readback_frame_no_ != frame_no)
+    return -EAGAIN;
+  if (readback_status_)
+    return readback_status_;
+  fence->Set(dup(readback_fence_.get()));
+  return 0;
+}
+
+void DrmDisplayCompositor::TraceValidatedFrame(uint64_t frame_no,
+                                               uint32_t device_layers,
+                                               uint32_t client_layers) {
+  ATRACE_INT(trace_names_.device_layers.c_str(), device_layers);
+  ATRACE_INT(trace_names_.client_layers.c_str(), client_layers);
+
+  std::lock_guard<std::mutex> lock(trace_lock_);
+  // SurfaceFlinger may validate the same frame more than once
+  if (!traced_frames_.insert(frame_no).second)
+    return;
+  // Frames which are validated but never presented don't keep their slice
+  // open forever
+  if (traced_frames_.size() > kMaxTracedFrames) {
+    ATRACE_ASYNC_END(trace_names_.frame.c_str(),
+                     (int32_t)*traced_frames_.begin());
+    traced_frames_.erase(traced_frames_.begin());
+  }
+  ATRACE_ASYNC_BEGIN(trace_names_.frame.c_str(), (int32_t)frame_no);
+}
+
+void DrmDisplayCompositor::EndFrameSlice(uint64_t frame_no) {
+  std::lock_guard<std::mutex> lock(trace_lock_);
+  if (traced_frames_.erase(frame_no))
+    ATRACE_ASYNC_END(trace_names_.frame.c_str(), (int32_t)frame_no);
+}
+
 bool DrmDisplayCompositor::CountdownExpired() const {
   return flatten_countdown_ <= 0;
 }
 
 void DrmDisplayCompositor::Vsync(int display, int64_t timestamp) {
-  AutoLock lock(&lock_, __func__);
-  if (lock.Lock())
-    return;
-  flatten_countdown_--;
-  if (!CountdownExpired())
+  if (--flatten_countdown_ > 0)
     return;
-  lock.Unlock();
   int ret = FlattenActiveComposition();
   ALOGV("scene flattening triggered for display %d at timestamp %" PRIu64
         " result = %d \n",
@@ -987,30 +2238,61 @@ void DrmDisplayCompositor::Vsync(int display, int64_t timestamp) {
 }
 
 void DrmDisplayCompositor::Dump(std::ostringstream *out) const {
-  int ret = pthread_mutex_lock(&lock_);
-  if (ret)
-    return;
-
-  uint64_t num_frames = dump_frames_composited_;
-  dump_frames_composited_ = 0;
+  uint64_t num_frames = dump_frames_composited_.exchange(0);
+  uint64_t commit_ns = dump_commit_ns_.exchange(0);
 
   struct timespec ts;
-  ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-  if (ret) {
-    pthread_mutex_unlock(&lock_);
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (ret)
     return;
-  }
 
   uint64_t cur_ts = ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
-  uint64_t num_ms = (cur_ts - dump_last_timestamp_ns_) / (1000 * 1000);
+  uint64_t last_ts = dump_last_timestamp_ns_.exchange(cur_ts);
+  uint64_t num_ms = (cur_ts - last_ts) / (1000 * 1000);
   float fps = num_ms ? (num_frames * 1000.0f) / (num_ms) : 0.0f;
 
   *out << "--DrmDisplayCompositor[" << display_
        << "]: num_frames=" << num_frames << " num_ms=" << num_ms
-       << " fps=" << fps << "\n";
-
-  dump_last_timestamp_ns_ = cur_ts;
-
-  pthread_mutex_unlock(&lock_);
+       << " fps=" << fps
+       << " avg_commit_us=" << (num_frames ? commit_ns / num_frames / 1000 : 0)
+       << (scanout_ ? "" : " scanout=0") << "\n";
+  if (async_flip_enabled_ || async_flips_)
+    *out << "    async flips: " << async_flips_
+         << " fallbacks=" << async_flip_fallbacks_ << "\n";
+  if (front_buffer_enabled_)
+    *out << "    damage only commits: " << damage_commits_ << "\n";
+  if (sideband_flips_)
+    *out << "    sideband flips: " << sideband_flips_ << "\n";
+  if (fenced_frames_)
+    *out << "    frames waited on in userspace: " << fenced_frames_ << "\n";
+  histogram_worker_.Dump(out);
+
+  std::lock_guard<std::mutex> lk(failure_lock_);
+  *out << "    atomic failures: test=" << test_failures_
+       << " commit=" << commit_failures_ << "\n";
+  if (!failures_by_errno_.empty()) {
+    *out << "    by errno:";
+    for (const std::pair<const int, uint64_t> &e : failures_by_errno_)
+      *out << " " << e.first << "=" << e.second;
+    *out << "\n    by feature:";
+    for (int i = 0; i < kNumFailureFeatures; ++i)
+      *out << " " << FailureFeatureName(i) << "=" << failures_by_feature_[i];
+    *out << "\n";
+  }
+  for (const CommitFailure &failure : recent_failures_) {
+    *out << "    frame=" << failure.frame_no << " err=" << failure.err
+         << (failure.test_only ? " test" : " commit")
+         << " planes=" << failure.planes.size();
+    for (int i = 0; i < kNumFailureFeatures; ++i)
+      if (failure.features & (1 << i))
+        *out << " " << FailureFeatureName(i);
+    *out << "\n";
+    for (const CommitFailure::Plane &plane : failure.planes)
+      *out << "      plane=" << plane.plane_id
+           << " format=" << FourccToString(plane.format) << " modifier=0x"
+           << std::hex << plane.modifier << std::dec
+           << " scale=" << plane.scale_x << "x" << plane.scale_y
+           << " rotation=0x" << std::hex << plane.rotation << std::dec << "\n";
+  }
 }
 }  // namespace android
@@ -20,13 +20,25 @@
 #include "drmdisplaycomposition.h"
 #include "drmframebuffer.h"
 #include "drmhwcomposer.h"
+#include "fenceworker.h"
+#include "histogramworker.h"
 #include "resourcemanager.h"
+#include "sidebandstream.h"
+#include "sidebandworker.h"
 #include "vsyncworker.h"
 
 #include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <string>
 #include <tuple>
+#include <vector>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
@@ -41,7 +53,7 @@
 
 namespace android {
 
-class DrmDisplayCompositor {
+class DrmDisplayCompositor : public SidebandStream::Listener {
  public:
   DrmDisplayCompositor();
   ~DrmDisplayCompositor();
@@ -50,16 +62,111 @@ class DrmDisplayCompositor {
 
   std::unique_ptr<DrmDisplayComposition> CreateComposition() const;
   std::unique_ptr<DrmDisplayComposition> CreateInitializedComposition() const;
-  int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition);
+  // retire_fence, if given, is set to a fence that signals once the frame is
+  // on screen, if there's a way to know.
+  int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition,
+                       UniqueFd *retire_fence = NULL);
+  // Commits a frame handed back by fence_worker_ once its fences signaled,
+  // or drops it if waiting failed with status.
+  void ApplyFencedComposition(
+      std::unique_ptr<DrmDisplayComposition> composition, int status);
   int TestComposition(DrmDisplayComposition *composition);
+  // Test-only commit of plane showing a width x height buffer stretched over
+  // the whole of mode, 0 if the plane can scale it.
+  int TestPlaneScaling(DrmPlane *plane, const DrmMode &mode, uint32_t width,
+                       uint32_t height);
   int Composite();
   void Dump(std::ostringstream *out) const;
   void Vsync(int display, int64_t timestamp);
   void ClearDisplay();
+  // Hands the display's CRTC over to a lease. reserve is run with commit_lock_
+  // held and marks the CRTC leased, which no frame is committed to from then
+  // on, then the screen is cleared. FinishLease() shows the cleared frame
+  // again if the lease couldn't be created after all.
+  int ClearForLease(const std::function<int()> &reserve);
+  void FinishLease(bool leased);
+
+  // Hands each frame of a sideband stream to sideband_worker_, which flips it
+  // onto the plane the active composition shows the sideband layer on,
+  // without a new composition.
+  void OnSidebandFrame(std::shared_ptr<const SidebandFrame> frame,
+                       int acquire_fence) override;
+  // Called by sideband_worker_, makes a non-blocking flip whose page flip
+  // event is passed back to the worker. -EAGAIN if no composition on screen
+  // shows the stream.
+  int FlipSideband(std::shared_ptr<const SidebandFrame> frame,
+                   int acquire_fence);
+  // The latest frame of the sideband stream for the next composition, or NULL
+  // if none arrived yet. A dup of its acquire fence is put in acquire_fence.
+  std::shared_ptr<const SidebandFrame> GetSidebandFrame(
+      UniqueFd *acquire_fence);
+  void ClearSidebandFrame();
+
+  // Publishes the composition mix chosen by ValidateDisplay to systrace and
+  // opens the async slice that follows frame_no until it's been committed.
+  void TraceValidatedFrame(uint64_t frame_no, uint32_t device_layers,
+                           uint32_t client_layers);
 
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
+  // Readback writes a frame into a buffer as it's shown, through a writeback
+  // connector cloning the display's CRTC. Puts the HAL format it writes in
+  // hal_format, or fails if the display can't be read back.
+  int GetReadbackFormat(uint32_t *hal_format);
+  // Puts the fence signaled once the readback of frame_no is written in
+  // fence. -EAGAIN if the frame hasn't been committed yet.
+  int GetReadbackFence(uint64_t frame_no, UniqueFd *fence);
+
+  // Content sampling reads back a frame every interval_ms at most and
+  // computes histograms of its channels, see HistogramWorker. 0 stops it.
+  int SetContentSampling(uint32_t interval_ms);
+  bool GetContentSample(int64_t *timestamp_ns,
+                        std::vector<uint32_t> *histograms);
+
  private:
+  // Systrace counter names are specific to a display so that each display
+  // gets its own track, build them once instead of on every frame.
+  struct TraceNames {
+    std::string device_layers;
+    std::string client_layers;
+    std::string planes;
+    std::string flattened;
+    std::string commit_latency;
+    std::string commits_in_flight;
+    std::string frame;
+  };
+
+  // Features of a composition the kernel may refuse, used to tally which of
+  // them failed atomic tests and commits involved.
+  enum FailureFeature {
+    kFailureScaling = 0,
+    kFailureRotation,
+    kFailureModifier,
+    kFailureYuv,
+    kFailureInFence,
+    kFailureModeset,
+    kFailureWriteback,
+    kNumFailureFeatures,
+  };
+
+  // Signature of a failed atomic test or commit
+  struct CommitFailure {
+    struct Plane {
+      uint32_t plane_id;
+      uint32_t format;
+      uint64_t modifier;
+      float scale_x;
+      float scale_y;
+      uint64_t rotation;
+    };
+
+    uint64_t frame_no;
+    int err;
+    bool test_only;
+    uint32_t features;
+    std::vector<Plane> planes;
+  };
+
   struct ModeState {
     bool needs_modeset = false;
     DrmMode mode;
@@ -74,53 +181,164 @@ class DrmDisplayCompositor {
   static const int kAcquireWaitTries = 5;
   static const int kAcquireWaitTimeoutMs = 100;
 
+  int WaitAcquireFence(int fence_fd);
+  // Collects the acquire fences of the layers shown on planes without
+  // IN_FENCE_FD on acquire_timeline_ up to point, or merges them into fence
+  // if that's not possible. Returns whether there were any.
+  bool MergeUserspaceFences(DrmDisplayComposition *display_comp,
+                            UniqueFd *fence, uint64_t *point);
   int CommitFrame(DrmDisplayComposition *display_comp, bool test_only,
                   DrmConnector *writeback_conn = NULL,
                   DrmHwcBuffer *writeback_buffer = NULL);
+  // Flipping a fullscreen layer without waiting for vblank, see CommitFrame()
+  bool CanAsyncFlip(DrmDisplayComposition *display_comp);
+  int AsyncFlip(DrmDisplayComposition *display_comp);
+  // Front buffer rendering, where the buffer on screen is drawn into and only
+  // the damage needs to be passed on, see CommitFrame()
+  bool IsDamageOnly(DrmDisplayComposition *display_comp);
+  int CommitDamage(DrmDisplayComposition *display_comp);
   int SetupWritebackCommit(drmModeAtomicReqPtr pset, uint32_t crtc_id,
                            DrmConnector *writeback_conn,
                            DrmHwcBuffer *writeback_buffer);
+  void RecordCommitFailure(DrmDisplayComposition *display_comp, int err,
+                           bool test_only, bool writeback);
   int ApplyDpms(DrmDisplayComposition *display_comp);
   int DisablePlanes(DrmDisplayComposition *display_comp);
 
-  void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
-                  int status, bool writeback = false);
+  // The *Locked variants must be called with commit_lock_ held
+  void ClearDisplayLocked();
+  void ApplyFrameLocked(std::unique_ptr<DrmDisplayComposition> composition,
+                        int status, bool writeback = false,
+                        UniqueFd *out_fence = NULL);
   int FlattenActiveComposition();
   int FlattenSerial(DrmConnector *writeback_conn);
   int FlattenConcurrent(DrmConnector *writeback_conn);
   int FlattenOnDisplay(std::unique_ptr<DrmDisplayComposition> &src,
                        DrmConnector *writeback_conn, DrmMode &src_mode,
-                       DrmHwcLayer *writeback_layer);
+                       DrmPlane *scanout_plane, DrmHwcLayer *writeback_layer);
+  // The HAL format writeback output is allocated in, scanout_plane is the
+  // plane it's shown on afterwards if any.
+  int ChooseWritebackFormat(DrmConnector *writeback_conn,
+                            DrmPlane *scanout_plane, uint32_t *hal_format);
+  // The format of an imported writeback buffer is up to gralloc, which may
+  // not be the one that was chosen
+  int CheckWritebackFormat(DrmConnector *writeback_conn, uint32_t format);
+  DrmConnector *GetReadbackConnector();
+  // Imports the buffer of the next content sample, readback_conn is set to
+  // the connector that writes it and sample_buffer to the buffer imported.
+  std::unique_ptr<DrmHwcLayer> CreateSampleLayer(
+      DrmConnector **readback_conn, sp<GraphicBuffer> *sample_buffer);
 
   bool CountdownExpired() const;
 
   std::tuple<int, uint32_t> CreateModeBlob(const DrmMode &mode);
+  // Closes the async trace slice of frame_no, if it's open
+  void EndFrameSlice(uint64_t frame_no);
 
   ResourceManager *resource_manager_;
   int display_;
 
-  std::unique_ptr<DrmDisplayComposition> active_composition_;
+  // The composition currently on screen. It's replaced as a whole with
+  // std::atomic_store once a commit succeeds, so readers take a snapshot with
+  // std::atomic_load instead of waiting for the commit lock.
+  std::shared_ptr<DrmDisplayComposition> active_composition_;
 
   bool initialized_;
   bool active_;
   bool use_hw_overlays_;
+  // Headless devices may not scan anything out, see DrmDevice::scanout()
+  bool scanout_;
+  // Opt-in with hwc.drm.writeback_format=nv12, dropped if gralloc lays out
+  // buffers in a YUV format the connector can't write
+  std::atomic<bool> writeback_yuv_;
 
   ModeState mode_;
 
   int framebuffer_index_;
   DrmFramebuffer framebuffers_[DRM_DISPLAY_BUFFERS];
 
-  // mutable since we need to acquire in Dump()
-  mutable pthread_mutex_t lock_;
+  // Serializes everything that talks to the kernel on behalf of this display
+  // along with the state those commits consume (mode_, active_). It's held
+  // across the commit ioctl, so nothing on the vsync or dump path may wait
+  // on it.
+  pthread_mutex_t commit_lock_;
+
+  // Protects the writeback framebuffers and framebuffer_index_
+  pthread_mutex_t lock_;
 
   // State tracking progress since our last Dump(). These are mutable since
   // we need to reset them on every Dump() call.
-  mutable uint64_t dump_frames_composited_;
-  mutable uint64_t dump_last_timestamp_ns_;
+  mutable std::atomic<uint64_t> dump_frames_composited_;
+  mutable std::atomic<uint64_t> dump_last_timestamp_ns_;
+  mutable std::atomic<uint64_t> dump_commit_ns_;
   VSyncWorker vsync_worker_;
-  int64_t flatten_countdown_;
+  std::atomic<int64_t> flatten_countdown_;
   std::unique_ptr<Planner> planner_;
   int writeback_fence_;
+  DrmSyncobjTimeline acquire_timeline_;
+  FenceWorker fence_worker_;
+  std::atomic<uint64_t> fenced_frames_;
+  // Timeline point of the last frame fence_worker_ dropped, which is
+  // signaled once a later frame is applied. Touched with commit_lock_ held.
+  SyncTimeline *dropped_timeline_;
+  uint32_t dropped_point_;
+
+  // Opt-in with hwc.drm.async_flip, tearing is accepted in exchange for
+  // showing a single fullscreen layer as soon as it's ready.
+  std::atomic<bool> async_flip_enabled_;
+  int async_flip_consecutive_failures_;
+  std::atomic<uint64_t> async_flips_;
+  std::atomic<uint64_t> async_flip_fallbacks_;
+
+  // Opt-in with hwc.drm.front_buffer, and per layer by the client. The last
+  // commit was damage only when damage_committed_ is set, it left the active
+  // composition's framebuffers on screen.
+  bool front_buffer_enabled_;
+  bool damage_committed_;
+  std::atomic<uint64_t> damage_commits_;
+
+  // The frame on screen when the display was cleared for a lease
+  std::shared_ptr<DrmDisplayComposition> leased_composition_;
+
+  // Latest frame of the sideband stream, and the frames flipped since the
+  // last composition: the one on screen and the one being flipped. The
+  // latter two are only touched with commit_lock_ held. Each frame goes back
+  // to the producer once none of them, nor any composition, holds it.
+  std::mutex sideband_lock_;
+  std::shared_ptr<const SidebandFrame> sideband_frame_;
+  UniqueFd sideband_fence_;
+  DrmHwcLayer sideband_layer_;
+  DrmHwcLayer sideband_pending_layer_;
+  SidebandWorker sideband_worker_;
+  std::atomic<uint64_t> sideband_flips_;
+
+  // Outcome of the last frame that was read back
+  std::mutex readback_lock_;
+  int64_t readback_frame_no_;
+  int readback_status_;
+  UniqueFd readback_fence_;
+
+  // Mutable since Dump() takes the worker lock
+  mutable HistogramWorker histogram_worker_;
+
+  TraceNames trace_names_;
+  std::atomic<int> commits_in_flight_;
+  // Frame numbers of the async trace slices still open, each is closed once
+  // its frame is committed or dropped. Frames are validated on
+  // SurfaceFlinger's thread and committed on fence_worker_'s, hence the lock.
+  static const size_t kMaxTracedFrames = 8;
+  std::mutex trace_lock_;
+  std::set<uint64_t> traced_frames_;
+
+  // Failed atomic tests and commits, by errno, by feature and the most
+  // recent ones in full.
+  static const size_t kMaxCommitFailures = 16;
+  mutable std::mutex failure_lock_;
+  uint64_t test_failures_;
+  uint64_t commit_failures_;
+  std::map<int, uint64_t> failures_by_errno_;
+  uint64_t failures_by_feature_[kNumFailureFeatures];
+  std::deque<CommitFailure> recent_failures_;
 };
 }  // namespace android
 
@@ -49,7 +49,7 @@ void DrmEncoder::AddPossibleClone(DrmEncoder *possible_clone) {
 
 void DrmEncoder::set_crtc(DrmCrtc *crtc) {
   crtc_ = crtc;
-  display_ = crtc->display();
+  display_ = crtc ? crtc->display() : -1;
 }
 
 int DrmEncoder::display() const {
@@ -18,12 +18,15 @@
 
 #include "drmeventlistener.h"
 #include "drmdevice.h"
+#include "drmhwcomposer.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <linux/netlink.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 #include <log/log.h>
@@ -54,6 +57,10 @@ int DrmEventListener::Init() {
     return -errno;
   }
 
+  char debounce_ms[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.hotplug_debounce_ms", debounce_ms, "100");
+  debounce_ns_ = strtoll(debounce_ms, NULL, 10) * 1000 * 1000;
+
   FD_ZERO(&fds_);
   FD_SET(drm_->fd(), &fds_);
   FD_SET(uevent_fd_.get(), &fds_);
@@ -62,7 +69,8 @@ int DrmEventListener::Init() {
   return InitWorker();
 }
 
-void DrmEventListener::RegisterHotplugHandler(DrmEventHandler *handler) {
+void DrmEventListener::RegisterHotplugHandler(
+    DrmHotplugEventHandler *handler) {
   assert(!hotplug_handler_);
   hotplug_handler_.reset(handler);
 }
@@ -78,61 +86,126 @@ void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
   delete handler;
 }
 
+void DrmEventListener::SequenceHandler(int /* fd */, uint64_t sequence,
+                                       uint64_t ns, uint64_t user_data) {
+  DrmSequenceEventHandler *handler = (DrmSequenceEventHandler *)user_data;
+  if (!handler)
+    return;
+
+  handler->HandleSequence(sequence, ns);
+}
+
 void DrmEventListener::UEventHandler() {
   char buffer[1024];
   int ret;
 
-  struct timespec ts;
-  uint64_t timestamp = 0;
-  ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-  if (!ret)
-    timestamp = ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
-  else
-    ALOGE("Failed to get monotonic clock on hotplug %d", ret);
-
+  // Drain the uevents that are queued without blocking the drm events
   while (true) {
-    ret = read(uevent_fd_.get(), &buffer, sizeof(buffer));
+    ret = recv(uevent_fd_.get(), &buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
     if (ret == 0) {
       return;
     } else if (ret < 0) {
-      ALOGE("Got error reading uevent %d", ret);
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        ALOGE("Got error reading uevent %d", -errno);
       return;
     }
+    buffer[ret] = '\0';
 
     if (!hotplug_handler_)
       continue;
 
-    bool drm_event = false, hotplug_event = false;
+    bool drm_event = false, hotplug_event = false, property_event = false;
+    uint32_t connector_id = 0;
     for (int i = 0; i < ret;) {
       char *event = buffer + i;
-      if (strcmp(event, "DEVTYPE=drm_minor"))
+      if (!strcmp(event, "DEVTYPE=drm_minor"))
         drm_event = true;
-      else if (strcmp(event, "HOTPLUG=1"))
+      else if (!strcmp(event, "HOTPLUG=1"))
         hotplug_event = true;
+      else if (!strncmp(event, "CONNECTOR=", strlen("CONNECTOR=")))
+        connector_id = strtoul(event + strlen("CONNECTOR="), NULL, 10);
+      else if (!strncmp(event, "PROPERTY=", strlen("PROPERTY=")))
+        property_event = true;
 
       i += strlen(event) + 1;
     }
 
-    if (drm_event && hotplug_event)
-      hotplug_handler_->HandleEvent(timestamp);
+    if (!drm_event || !hotplug_event)
+      continue;
+
+    // A connector property changed (link status, content protection, ...)
+    // which doesn't change what's plugged in.
+    if (connector_id && property_event) {
+      ALOGV("Ignoring property change uevent for connector %u", connector_id);
+      continue;
+    }
+
+    if (connector_id)
+      hotplug_connectors_.insert(connector_id);
+    else
+      hotplug_all_connectors_ = true;
+
+    int64_t now = GetMonotonicNs();
+    hotplug_timestamp_us_ = now / 1000;
+    hotplug_deadline_ns_ = now + debounce_ns_;
   }
 }
 
+void DrmEventListener::DispatchHotplug() {
+  hotplug_deadline_ns_ = -1;
+  if (!hotplug_handler_)
+    return;
+
+  if (hotplug_all_connectors_) {
+    hotplug_handler_->HandleHotplug(hotplug_timestamp_us_, 0);
+  } else {
+    for (uint32_t connector_id : hotplug_connectors_)
+      hotplug_handler_->HandleHotplug(hotplug_timestamp_us_, connector_id);
+  }
+  hotplug_all_connectors_ = false;
+  hotplug_connectors_.clear();
+}
+
 void DrmEventListener::Routine() {
+  struct timeval timeout;
+  struct timeval *timeout_ptr = NULL;
+  if (hotplug_deadline_ns_ >= 0) {
+    int64_t remaining_ns = hotplug_deadline_ns_ - GetMonotonicNs();
+    if (remaining_ns <= 0) {
+      DispatchHotplug();
+      return;
+    }
+    timeout.tv_sec = remaining_ns / (1000 * 1000 * 1000);
+    timeout.tv_usec = (remaining_ns / 1000) % (1000 * 1000);
+    timeout_ptr = &timeout;
+  }
+
+  // select() overwrites the sets it's given, so hand it a copy
+  fd_set fds;
   int ret;
   do {
-    ret = select(max_fd_ + 1, &fds_, NULL, NULL, NULL);
+    fds = fds_;
+    ret = select(max_fd_ + 1, &fds, NULL, NULL, timeout_ptr);
   } while (ret == -1 && errno == EINTR);
 
-  if (FD_ISSET(drm_->fd(), &fds_)) {
+  if (ret < 0) {
+    ALOGE("Failed to wait for events %d", -errno);
+    return;
+  }
+  if (ret == 0)
+    return;
+
+  if (FD_ISSET(drm_->fd(), &fds)) {
     drmEventContext event_context =
-        {.version = 2,
+        {.version = 4,
          .vblank_handler = NULL,
-         .page_flip_handler = DrmEventListener::FlipHandler};
+         .page_flip_handler = DrmEventListener::FlipHandler,
+         .page_flip_handler2 = NULL,
+         .sequence_handler = DrmEventListener::SequenceHandler};
     drmHandleEvent(drm_->fd(), &event_context);
   }
 
-  if (FD_ISSET(uevent_fd_.get(), &fds_))
+  if (FD_ISSET(uevent_fd_.get(), &fds))
     UEventHandler();
 }
 }  // namespace android
@@ -20,6 +20,8 @@
 #include "autofd.h"
 #include "worker.h"
 
+#include <set>
+
 namespace android {
 
 class DrmDevice;
@@ -34,6 +36,28 @@ class DrmEventHandler {
   virtual void HandleEvent(uint64_t timestamp_us) = 0;
 };
 
+// Receives the events for sequences queued with drmCrtcQueueSequence, which
+// have to be given the handler as user_data. Unlike DrmEventHandler it isn't
+// deleted once the event has been delivered.
+class DrmSequenceEventHandler {
+ public:
+  virtual ~DrmSequenceEventHandler() {
+  }
+
+  virtual void HandleSequence(uint64_t sequence, uint64_t timestamp_ns) = 0;
+};
+
+class DrmHotplugEventHandler {
+ public:
+  virtual ~DrmHotplugEventHandler() {
+  }
+
+  // Called once per connector that changed after a burst of hotplug uevents
+  // has settled. connector_id is 0 if the kernel didn't say which connector
+  // the uevent was about, in which case all of them need checking.
+  virtual void HandleHotplug(uint64_t timestamp_us, uint32_t connector_id) = 0;
+};
+
 class DrmEventListener : public Worker {
  public:
   DrmEventListener(DrmDevice *drm);
@@ -42,23 +66,34 @@ class DrmEventListener : public Worker {
 
   int Init();
 
-  void RegisterHotplugHandler(DrmEventHandler *handler);
+  void RegisterHotplugHandler(DrmHotplugEventHandler *handler);
 
   static void FlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
                           unsigned int tv_usec, void *user_data);
+  static void SequenceHandler(int fd, uint64_t sequence, uint64_t ns,
+                              uint64_t user_data);
 
  protected:
   virtual void Routine();
 
  private:
   void UEventHandler();
+  void DispatchHotplug();
 
   fd_set fds_;
   UniqueFd uevent_fd_;
   int max_fd_ = -1;
 
   DrmDevice *drm_;
-  std::unique_ptr<DrmEventHandler> hotplug_handler_;
+  std::unique_ptr<DrmHotplugEventHandler> hotplug_handler_;
+
+  // Hotplug uevents tend to come in bursts, they're held back until no more
+  // have arrived for debounce_ns_.
+  int64_t debounce_ns_ = 0;
+  int64_t hotplug_deadline_ns_ = -1;
+  uint64_t hotplug_timestamp_us_ = 0;
+  bool hotplug_all_connectors_ = false;
+  std::set<uint32_t> hotplug_connectors_;
 };
 }  // namespace android
 
@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #include <sync/sync.h>
+#include <system/graphics.h>
 
 #include <ui/GraphicBuffer.h>
 
@@ -52,9 +53,11 @@ struct DrmFramebuffer {
     release_fence_fd_ = fd;
   }
 
-  bool Allocate(uint32_t w, uint32_t h) {
+  bool Allocate(uint32_t w, uint32_t h,
+                uint32_t format = PIXEL_FORMAT_RGB_888) {
     if (is_valid()) {
-      if (buffer_->getWidth() == w && buffer_->getHeight() == h)
+      if (buffer_->getWidth() == w && buffer_->getHeight() == h &&
+          (uint32_t)buffer_->getPixelFormat() == format)
         return true;
 
       if (release_fence_fd_ >= 0) {
@@ -65,9 +68,12 @@ struct DrmFramebuffer {
       }
       Clear();
     }
-    buffer_ = new GraphicBuffer(w, h, PIXEL_FORMAT_RGB_888,
-                                GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER |
-                                    GRALLOC_USAGE_HW_COMPOSER);
+    // YUV output is meant for video encoders, so gralloc lays it out for them
+    uint32_t usage = GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER |
+                     GRALLOC_USAGE_HW_COMPOSER;
+    if (format == HAL_PIXEL_FORMAT_YCBCR_420_888)
+      usage |= GRALLOC_USAGE_HW_VIDEO_ENCODER;
+    buffer_ = new GraphicBuffer(w, h, format, usage);
     release_fence_fd_ = -1;
     return is_valid();
   }
@@ -30,6 +30,7 @@ typedef struct hwc_drm_bo {
   uint32_t pitches[HWC_DRM_BO_MAX_PLANES];
   uint32_t offsets[HWC_DRM_BO_MAX_PLANES];
   uint32_t gem_handles[HWC_DRM_BO_MAX_PLANES];
+  uint64_t modifiers[HWC_DRM_BO_MAX_PLANES]; /* DRM_FORMAT_MOD_*, 0 if linear */
   uint32_t fb_id;
   int acquire_fence_fd;
   void *priv;
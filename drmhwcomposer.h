@@ -26,6 +26,7 @@
 #include <hardware/hwcomposer.h>
 #include "autofd.h"
 #include "drmhwcgralloc.h"
+#include "sidebandstream.h"
 
 struct hwc_import_context;
 
@@ -41,6 +42,9 @@ namespace android {
 
 class Importer;
 
+// CLOCK_MONOTONIC in nanoseconds, 0 if it can't be read
+int64_t GetMonotonicNs();
+
 class DrmHwcBuffer {
  public:
   DrmHwcBuffer() = default;
@@ -72,6 +76,9 @@ class DrmHwcBuffer {
   void Clear();
 
   int ImportBuffer(buffer_handle_t handle, Importer *importer);
+  // Replaces the framebuffer with one that reads the same planes as format,
+  // which must have the same layout as the format imported.
+  int ReinterpretFormat(int drm_fd, uint32_t format);
 
  private:
   hwc_drm_bo bo_;
@@ -137,6 +144,15 @@ struct DrmHwcLayer {
   uint16_t alpha = 0xffff;
   hwc_frect_t source_crop;
   hwc_rect_t display_frame;
+  // Parts of the buffer that changed since it was last presented, in buffer
+  // coordinates. Empty if unknown, a single empty rect if nothing changed.
+  std::vector<hwc_rect_t> damage;
+  // Frame of a sideband stream, which may be flipped without a new
+  // composition. It's kept from its producer for as long as it's held.
+  std::shared_ptr<const SidebandFrame> sideband_frame;
+  // The buffer is rendered to in place while it's shown, see
+  // HWC2_DRM_LAYER_SET_FRONT_BUFFER
+  bool front_buffer = false;
 
   UniqueFd acquire_fence;
   OutputFd release_fence;
@@ -20,10 +20,12 @@
 #include "drmhwctwo.h"
 #include "drmdisplaycomposition.h"
 #include "drmhwcomposer.h"
+#include "drmhwcvendor.h"
 #include "platform.h"
 #include "vsyncworker.h"
 
 #include <inttypes.h>
+#include <algorithm>
 #include <string>
 
 #include <cutils/properties.h>
@@ -68,19 +70,7 @@ HWC2::Error DrmHwcTwo::CreateDisplay(hwc2_display_t displ,
   displays_.emplace(std::piecewise_construct, std::forward_as_tuple(displ),
                     std::forward_as_tuple(&resource_manager_, drm, importer,
                                           displ, type));
-
-  DrmCrtc *crtc = drm->GetCrtcForDisplay(static_cast<int>(displ));
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display %d", static_cast<int>(displ));
-    return HWC2::Error::BadDisplay;
-  }
-  std::vector<DrmPlane *> display_planes;
-  for (auto &plane : drm->planes()) {
-    if (plane->GetCrtcSupported(*crtc))
-      display_planes.push_back(plane.get());
-  }
-  displays_.at(displ).Init(&display_planes);
-  return HWC2::Error::None;
+  return displays_.at(displ).Init();
 }
 
 HWC2::Error DrmHwcTwo::Init() {
@@ -129,8 +119,27 @@ HWC2::Error DrmHwcTwo::DestroyVirtualDisplay(hwc2_display_t display) {
 }
 
 void DrmHwcTwo::Dump(uint32_t *size, char *buffer) {
-  // TODO: Implement dump
-  unsupported(__func__, size, buffer);
+  supported(__func__);
+
+  if (buffer != NULL) {
+    uint32_t copied = std::min(*size, (uint32_t)dump_string_.size());
+    memcpy(buffer, dump_string_.data(), copied);
+    *size = copied;
+    return;
+  }
+
+  std::ostringstream out;
+  out << "-- drm_hwcomposer --\n";
+  for (std::pair<const hwc2_display_t, HwcDisplay> &dp : displays_)
+    dp.second.Dump(&out);
+
+  const std::vector<std::unique_ptr<DrmDevice>> &drms = resource_manager_
+                                                            .getDrmDevices();
+  for (const std::unique_ptr<DrmDevice> &drm : drms)
+    drm->watchdog()->Dump(&out);
+
+  dump_string_ = out.str();
+  *size = dump_string_.size();
 }
 
 uint32_t DrmHwcTwo::GetMaxVirtualDisplayCount() {
@@ -139,19 +148,69 @@ uint32_t DrmHwcTwo::GetMaxVirtualDisplayCount() {
   return 0;
 }
 
+HWC2::Error DrmHwcTwo::CreateLease(hwc2_display_t display,
+                                   int32_t *out_lease_fd,
+                                   uint32_t *out_lessee_id) {
+  supported(__func__);
+  auto it = displays_.find(display);
+  DrmDevice *drm = resource_manager_.GetDrmDevice(display);
+  if (it == displays_.end() || !drm)
+    return HWC2::Error::BadDisplay;
+
+  // Takes everything off the screen before the lessee gets it
+  int fd = it->second.CreateLease(out_lessee_id);
+  if (fd < 0)
+    return fd == -ENODEV ? HWC2::Error::BadDisplay : HWC2::Error::NoResources;
+  *out_lease_fd = fd;
+
+  UpdatePipes(drm);
+  HandleDisplayHotplug(display, DRM_MODE_DISCONNECTED);
+  return HWC2::Error::None;
+}
+
+HWC2::Error DrmHwcTwo::RevokeLease(hwc2_display_t display, uint32_t lessee_id) {
+  supported(__func__);
+  auto it = displays_.find(display);
+  DrmDevice *drm = resource_manager_.GetDrmDevice(display);
+  if (it == displays_.end() || !drm)
+    return HWC2::Error::BadDisplay;
+
+  if (drm->RevokeLease(lessee_id))
+    return HWC2::Error::BadParameter;
+
+  UpdatePipes(drm);
+  DrmConnector *conn = drm->GetConnectorForDisplay(static_cast<int>(display));
+  if (conn && conn->state() == DRM_MODE_CONNECTED) {
+    it->second.RequestPreferredConfig();
+    HandleDisplayHotplug(display, DRM_MODE_CONNECTED);
+  }
+  return HWC2::Error::None;
+}
+
+void DrmHwcTwo::UpdatePipes(DrmDevice *drm) {
+  for (std::pair<const hwc2_display_t, HwcDisplay> &d : displays_) {
+    if (resource_manager_.GetDrmDevice(d.first) != drm)
+      continue;
+    d.second.UpdatePipe();
+    d.second.UpdateScaledConfigs();
+  }
+}
+
 HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
                                         hwc2_callback_data_t data,
                                         hwc2_function_pointer_t function) {
   supported(__func__);
   auto callback = static_cast<HWC2::Callback>(descriptor);
 
-  if (!function) {
-    callbacks_.erase(callback);
-    return HWC2::Error::None;
+  {
+    std::lock_guard<std::mutex> lk(callbacks_lock_);
+    if (!function) {
+      callbacks_.erase(callback);
+      return HWC2::Error::None;
+    }
+    callbacks_.emplace(callback, HwcCallback(data, function));
   }
 
-  callbacks_.emplace(callback, HwcCallback(data, function));
-
   switch (callback) {
     case HWC2::Callback::Hotplug: {
       auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(function);
@@ -190,7 +249,31 @@ void DrmHwcTwo::HwcDisplay::ClearDisplay() {
   compositor_.ClearDisplay();
 }
 
-HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
+int DrmHwcTwo::HwcDisplay::CreateLease(uint32_t *lessee_id) {
+  int display = static_cast<int>(handle_);
+  // The pipe without the CRTC is published before a frame may be committed
+  // again, frames that had it already are dropped by the compositor.
+  int ret = compositor_.ClearForLease([this, display]() {
+    int ret = drm_->ReserveLease(display);
+    if (!ret)
+      UpdatePipe();
+    return ret;
+  });
+  if (ret)
+    return ret;
+
+  int fd = drm_->CreateLease(display, lessee_id);
+  if (fd < 0) {
+    drm_->CancelLease(display);
+    UpdatePipe();
+  }
+  compositor_.FinishLease(fd >= 0);
+  if (fd < 0)
+    UpdateScaledConfigs();
+  return fd;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::Init() {
   supported(__func__);
   planner_ = Planner::CreateInstance(drm_);
   if (!planner_) {
@@ -205,23 +288,28 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::NoResources;
   }
 
-  // Split up the given display planes into primary and overlay to properly
-  // interface with the composition
   char use_overlay_planes_prop[PROPERTY_VALUE_MAX];
   property_get("hwc.drm.use_overlay_planes", use_overlay_planes_prop, "1");
-  bool use_overlay_planes = atoi(use_overlay_planes_prop);
-  for (auto &plane : *planes) {
-    if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
-      primary_planes_.push_back(plane);
-    else if (use_overlay_planes && (plane)->type() == DRM_PLANE_TYPE_OVERLAY)
-      overlay_planes_.push_back(plane);
+  use_overlay_planes_ = atoi(use_overlay_planes_prop);
+
+  // Comma separated render scales in percent, each is offered as an extra
+  // config of every mode the primary plane can scale it to
+  char render_scales_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.render_scales", render_scales_prop, "");
+  char *saveptr = NULL;
+  for (char *entry = strtok_r(render_scales_prop, ",", &saveptr); entry;
+       entry = strtok_r(NULL, ",", &saveptr)) {
+    int scale_percent = atoi(entry);
+    if (scale_percent < kMinRenderScalePercent || scale_percent >= 100) {
+      ALOGW("Ignoring render scale %s", entry);
+      continue;
+    }
+    render_scales_.push_back(scale_percent);
   }
 
-  crtc_ = drm_->GetCrtcForDisplay(display);
-  if (!crtc_) {
-    ALOGE("Failed to get crtc for display %d", display);
-    return HWC2::Error::BadDisplay;
-  }
+  // External displays which aren't plugged in don't have a CRTC yet, they
+  // get one on hotplug.
+  UpdatePipe();
 
   connector_ = drm_->GetConnectorForDisplay(display);
   if (!connector_) {
@@ -235,9 +323,98 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::BadDisplay;
   }
 
+  UpdateScaledConfigs();
   return ChosePreferredConfig();
 }
 
+void DrmHwcTwo::HwcDisplay::UpdatePipe() {
+  auto pipe = std::make_shared<Pipe>();
+  pipe->crtc = drm_->GetCrtcForDisplay(static_cast<int>(handle_));
+  if (pipe->crtc && pipe->crtc->leased())
+    pipe->crtc = NULL;
+
+  // Split up the display planes into primary and overlay to properly
+  // interface with the composition
+  for (auto &plane : drm_->planes()) {
+    if (!pipe->crtc || plane->leased() ||
+        !plane->GetCrtcSupported(*pipe->crtc))
+      continue;
+    if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
+      pipe->primary_planes.push_back(plane.get());
+    else if (use_overlay_planes_ && plane->type() == DRM_PLANE_TYPE_OVERLAY)
+      pipe->overlay_planes.push_back(plane.get());
+  }
+
+  std::atomic_store(&pipe_, std::shared_ptr<const Pipe>(std::move(pipe)));
+
+  std::lock_guard<std::mutex> lock(scaled_configs_lock_);
+  scaled_configs_.clear();
+}
+
+const DrmMode *DrmHwcTwo::HwcDisplay::FindConfig(const DrmModeList &modes,
+                                                 hwc2_config_t config,
+                                                 int *scale_percent) {
+  uint32_t mode_id = config & ((1 << kConfigScaleShift) - 1);
+  auto mode = std::find_if(modes.modes.begin(), modes.modes.end(),
+                           [mode_id](DrmMode const &m) {
+                             return m.id() == mode_id;
+                           });
+  if (mode == modes.modes.end())
+    return NULL;
+
+  *scale_percent = 100;
+  if (config >> kConfigScaleShift) {
+    *scale_percent = config >> kConfigScaleShift;
+    if (std::find(render_scales_.begin(), render_scales_.end(),
+                  *scale_percent) == render_scales_.end() ||
+        !CanScaleMode(*mode, *scale_percent))
+      return NULL;
+  }
+  return &*mode;
+}
+
+bool DrmHwcTwo::HwcDisplay::CanScaleMode(const DrmMode &mode,
+                                         int scale_percent) {
+  std::lock_guard<std::mutex> lock(scaled_configs_lock_);
+  return scaled_configs_.count(MakeConfig(mode.id(), scale_percent));
+}
+
+void DrmHwcTwo::HwcDisplay::UpdateScaledConfigs() {
+  // Each test allocates a buffer and tries a modeset, so they're only run
+  // when the pipe or the modes change, and without holding the lock.
+  std::set<hwc2_config_t> scaled_configs;
+  std::shared_ptr<const Pipe> pipe = std::atomic_load(&pipe_);
+  if (connector_ && pipe->crtc && !pipe->primary_planes.empty()) {
+    std::shared_ptr<const DrmModeList> modes = connector_->modes();
+    for (const DrmMode &mode : modes->modes) {
+      for (int scale_percent : render_scales_) {
+        int ret = compositor_.TestPlaneScaling(
+            pipe->primary_planes.front(), mode,
+            RenderSize(mode.h_display(), scale_percent),
+            RenderSize(mode.v_display(), scale_percent));
+        if (ret)
+          ALOGI("Primary plane can't scale %d%% of %s on display %" PRIu64
+                " %d",
+                scale_percent, mode.name().c_str(), handle_, ret);
+        else
+          scaled_configs.insert(MakeConfig(mode.id(), scale_percent));
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(scaled_configs_lock_);
+  scaled_configs_ = std::move(scaled_configs);
+}
+
+void DrmHwcTwo::HwcDisplay::RequestPreferredConfig() {
+  preferred_config_pending_ = true;
+}
+
+void DrmHwcTwo::HwcDisplay::ApplyPendingConfig() {
+  if (preferred_config_pending_.exchange(false))
+    ChosePreferredConfig();
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::ChosePreferredConfig() {
   // Fetch the number of modes from the display
   uint32_t num_configs;
@@ -245,7 +422,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ChosePreferredConfig() {
   if (err != HWC2::Error::None || !num_configs)
     return err;
 
-  return SetActiveConfig(connector_->get_preferred_mode_id());
+  return SetActiveConfig(connector_->modes()->preferred_mode_id);
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::RegisterVsyncCallback(
@@ -279,11 +456,12 @@ HWC2::Error DrmHwcTwo::HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetActiveConfig(hwc2_config_t *config) {
   supported(__func__);
+  ApplyPendingConfig();
   DrmMode const &mode = connector_->active_mode();
   if (mode.id() == 0)
     return HWC2::Error::BadConfig;
 
-  *config = mode.id();
+  *config = MakeConfig(mode.id(), render_scale_percent_);
   return HWC2::Error::None;
 }
 
@@ -307,7 +485,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetChangedCompositionTypes(
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetClientTargetSupport(uint32_t width,
                                                           uint32_t height,
-                                                          int32_t /*format*/,
+                                                          int32_t format,
                                                           int32_t dataspace) {
   supported(__func__);
   std::pair<uint32_t, uint32_t> min = drm_->min_resolution();
@@ -323,8 +501,15 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetClientTargetSupport(uint32_t width,
       dataspace != HAL_DATASPACE_STANDARD_UNSPECIFIED)
     return HWC2::Error::Unsupported;
 
-  // TODO: Validate format can be handled by either GL or planes
-  return HWC2::Error::None;
+  // The client target is shown on a primary plane, so cheaper formats such as
+  // RGB565 are fine as long as one of them can scan them out.
+  uint32_t drm_format = importer_->ConvertHalFormatToDrm(format);
+  std::shared_ptr<const Pipe> pipe = std::atomic_load(&pipe_);
+  for (DrmPlane *plane : pipe->primary_planes) {
+    if (plane->IsFormatSupported(drm_format))
+      return HWC2::Error::None;
+  }
+  return HWC2::Error::Unsupported;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetColorModes(uint32_t *num_modes,
@@ -343,12 +528,11 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayAttribute(hwc2_config_t config,
                                                        int32_t attribute_in,
                                                        int32_t *value) {
   supported(__func__);
-  auto mode = std::find_if(connector_->modes().begin(),
-                           connector_->modes().end(),
-                           [config](DrmMode const &m) {
-                             return m.id() == config;
-                           });
-  if (mode == connector_->modes().end()) {
+  // Hotplug may replace the modes meanwhile, the snapshot stays valid
+  std::shared_ptr<const DrmModeList> modes = connector_->modes();
+  int scale_percent;
+  const DrmMode *mode = FindConfig(*modes, config, &scale_percent);
+  if (!mode) {
     ALOGE("Could not find active mode for %d", config);
     return HWC2::Error::BadConfig;
   }
@@ -359,10 +543,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayAttribute(hwc2_config_t config,
   auto attribute = static_cast<HWC2::Attribute>(attribute_in);
   switch (attribute) {
     case HWC2::Attribute::Width:
-      *value = mode->h_display();
+      *value = RenderSize(mode->h_display(), scale_percent);
       break;
     case HWC2::Attribute::Height:
-      *value = mode->v_display();
+      *value = RenderSize(mode->v_display(), scale_percent);
       break;
     case HWC2::Attribute::VsyncPeriod:
       // in nanoseconds
@@ -370,11 +554,17 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayAttribute(hwc2_config_t config,
       break;
     case HWC2::Attribute::DpiX:
       // Dots per 1000 inches
-      *value = mm_width ? (mode->h_display() * kUmPerInch) / mm_width : -1;
+      *value = mm_width ? (RenderSize(mode->h_display(), scale_percent) *
+                           kUmPerInch) /
+                              mm_width
+                        : -1;
       break;
     case HWC2::Attribute::DpiY:
       // Dots per 1000 inches
-      *value = mm_height ? (mode->v_display() * kUmPerInch) / mm_height : -1;
+      *value = mm_height ? (RenderSize(mode->v_display(), scale_percent) *
+                            kUmPerInch) /
+                               mm_height
+                         : -1;
       break;
     default:
       *value = -1;
@@ -386,30 +576,39 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayAttribute(hwc2_config_t config,
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayConfigs(uint32_t *num_configs,
                                                      hwc2_config_t *configs) {
   supported(__func__);
-  // Since this callback is normally invoked twice (once to get the count, and
-  // once to populate configs), we don't really want to read the edid
-  // redundantly. Instead, only update the modes on the first invocation. While
-  // it's possible this will result in stale modes, it'll all come out in the
-  // wash when we try to set the active config later.
-  if (!configs) {
+  // Modes are kept up to date by the hotplug handler, so they only need to be
+  // probed here if the connector has never been probed before.
+  std::shared_ptr<const DrmModeList> modes = connector_->modes();
+  if (!configs && modes->modes.empty()) {
     int ret = connector_->UpdateModes();
     if (ret) {
       ALOGE("Failed to update display modes %d", ret);
       return HWC2::Error::BadDisplay;
     }
+    modes = connector_->modes();
+    UpdateScaledConfigs();
   }
 
-  auto num_modes = static_cast<uint32_t>(connector_->modes().size());
+  // The modes themselves come first, followed by the scaled configs the
+  // primary plane passed a test commit of
+  std::vector<hwc2_config_t> all_configs;
+  for (const DrmMode &mode : modes->modes)
+    all_configs.push_back(mode.id());
+  for (const DrmMode &mode : modes->modes)
+    for (int scale_percent : render_scales_)
+      if (CanScaleMode(mode, scale_percent))
+        all_configs.push_back(MakeConfig(mode.id(), scale_percent));
+
   if (!configs) {
-    *num_configs = num_modes;
+    *num_configs = static_cast<uint32_t>(all_configs.size());
     return HWC2::Error::None;
   }
 
   uint32_t idx = 0;
-  for (const DrmMode &mode : connector_->modes()) {
+  for (hwc2_config_t config : all_configs) {
     if (idx >= *num_configs)
       break;
-    configs[idx++] = mode.id();
+    configs[idx++] = config;
   }
   *num_configs = idx;
   return HWC2::Error::None;
@@ -438,8 +637,25 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayRequests(int32_t *display_requests,
   supported(__func__);
   // TODO: I think virtual display should request
   //      HWC2_DISPLAY_REQUEST_WRITE_CLIENT_TARGET_TO_OUTPUT here
-  unsupported(__func__, display_requests, num_elements, layers, layer_requests);
-  *num_elements = 0;
+  //
+  // HWC2_DISPLAY_REQUEST_FLIP_CLIENT_TARGET is never needed, the client
+  // target is only scanned out when there are client layers to go in it.
+  if (display_requests)
+    *display_requests = 0;
+
+  uint32_t num_requests = 0;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    if (!l.second.clear_client_target())
+      continue;
+    if (layers && num_requests < *num_elements)
+      layers[num_requests] = l.first;
+    if (layer_requests && num_requests < *num_elements)
+      layer_requests[num_requests] = static_cast<int32_t>(
+          HWC2::LayerRequest::ClearClientTarget);
+    ++num_requests;
+  }
+  if (!layers && !layer_requests)
+    *num_elements = num_requests;
   return HWC2::Error::None;
 }
 
@@ -490,15 +706,39 @@ void DrmHwcTwo::HwcDisplay::AddFenceToRetireFence(int fd) {
   if (fd < 0)
     return;
 
-  if (next_retire_fence_.get() >= 0) {
-    int old_fence = next_retire_fence_.get();
-    next_retire_fence_.Set(sync_merge("dc_retire", old_fence, fd));
+  if (retire_fence_.get() >= 0) {
+    int old_fence = retire_fence_.get();
+    retire_fence_.Set(sync_merge("dc_retire", old_fence, fd));
   } else {
-    next_retire_fence_.Set(dup(fd));
+    retire_fence_.Set(dup(fd));
   }
 }
 
+void DrmHwcTwo::HwcDisplay::Dump(std::ostringstream *out) {
+  *out << "- Display " << handle_ << ": " << layers_.size() << " layers, "
+       << "frame " << frame_no_ << "\n";
+  compositor_.Dump(out);
+}
+
+static void ScaleDisplayFrame(hwc_rect_t *frame, float scale_x,
+                              float scale_y) {
+  if (scale_x == 1.0f && scale_y == 1.0f)
+    return;
+  frame->left = static_cast<int>(frame->left * scale_x + 0.5f);
+  frame->top = static_cast<int>(frame->top * scale_y + 0.5f);
+  frame->right = static_cast<int>(frame->right * scale_x + 0.5f);
+  frame->bottom = static_cast<int>(frame->bottom * scale_y + 0.5f);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
+  DrmIoctlWatchdog::FrameContext watchdog_context(handle_, frame_no_);
+
+  // Until it's bound to a CRTC there's nothing to show the display's frames
+  // on, they're dropped without fences.
+  std::shared_ptr<const Pipe> pipe = std::atomic_load(&pipe_);
+  if (!pipe->crtc)
+    return HWC2::Error::None;
+
   std::vector<DrmCompositionDisplayLayersMap> layers_map;
   layers_map.emplace_back();
   DrmCompositionDisplayLayersMap &map = layers_map.back();
@@ -517,12 +757,16 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
       if (comp_type == HWC2::Composition::Device) {
         if (!importer_->CanImportBuffer(l.second.buffer()))
           comp_type = HWC2::Composition::Client;
+      } else if (comp_type == HWC2::Composition::Sideband) {
+        if (!ShowsSideband(l.second))
+          comp_type = HWC2::Composition::Client;
       }
     } else
       comp_type = l.second.validated_type();
 
     switch (comp_type) {
       case HWC2::Composition::Device:
+      case HWC2::Composition::Sideband:
         z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
         break;
       case HWC2::Composition::Client:
@@ -544,6 +788,17 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
     DrmHwcLayer layer;
     l.second->PopulateDrmLayer(&layer);
+    // Layers on planes are positioned in the render size too
+    if (l.second != &client_layer_)
+      ScaleDisplayFrame(&layer.display_frame, frame_scale_x_, frame_scale_y_);
+    if (l.second->sf_type() == HWC2::Composition::Sideband) {
+      layer.sideband_frame = compositor_.GetSidebandFrame(
+          &layer.acquire_fence);
+      // The stream has yet to produce a frame, keep its plane empty for now
+      if (!layer.sideband_frame)
+        continue;
+      layer.sf_handle = layer.sideband_frame->buffer();
+    }
     int ret = layer.ImportBuffer(importer_.get());
     if (ret) {
       ALOGE("Failed to import layer, ret=%d", ret);
@@ -554,7 +809,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
 
   std::unique_ptr<DrmDisplayComposition> composition = compositor_
                                                            .CreateComposition();
-  composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
+  composition->Init(drm_, pipe->crtc, importer_.get(), planner_.get(),
+                    frame_no_);
 
   // TODO: Don't always assume geometry changed
   int ret = composition->SetLayers(map.layers.data(), map.layers.size(), true);
@@ -563,8 +819,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
     return HWC2::Error::BadLayer;
   }
 
-  std::vector<DrmPlane *> primary_planes(primary_planes_);
-  std::vector<DrmPlane *> overlay_planes(overlay_planes_);
+  std::vector<DrmPlane *> primary_planes(pipe->primary_planes);
+  std::vector<DrmPlane *> overlay_planes(pipe->overlay_planes);
   ret = composition->Plan(&primary_planes, &overlay_planes);
   if (ret) {
     ALOGE("Failed to plan the composition ret=%d", ret);
@@ -584,8 +840,29 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   if (test) {
     ret = compositor_.TestComposition(composition.get());
   } else {
-    AddFenceToRetireFence(composition->take_out_fence());
-    ret = compositor_.ApplyComposition(std::move(composition));
+    if (readback_buffer_) {
+      std::unique_ptr<DrmHwcLayer> readback(new DrmHwcLayer());
+      readback->sf_handle = readback_buffer_;
+      readback->acquire_fence = std::move(readback_release_fence_);
+      readback_buffer_ = NULL;
+      if (!readback->ImportBuffer(importer_.get())) {
+        composition->set_readback(std::move(readback));
+        readback_frame_no_ = frame_no_;
+      } else {
+        ALOGE("Failed to import readback buffer");
+      }
+    }
+
+    UniqueFd retire_fence;
+    ret = compositor_.ApplyComposition(std::move(composition), &retire_fence);
+    AddFenceToRetireFence(retire_fence.get());
+    // The buffers the layers showed before are released once this frame has
+    // replaced them on screen
+    for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+      if (retire_fence.get() >= 0 &&
+          l.second.validated_type() == HWC2::Composition::Device)
+        l.second.set_release_fence(dup(retire_fence.get()));
+    }
   }
   if (ret) {
     if (!test)
@@ -595,6 +872,46 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::UpdateSidebandStream() {
+  const native_handle_t *handle = NULL;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    if (l.second.sf_type() == HWC2::Composition::Sideband &&
+        l.second.sideband_stream()) {
+      handle = l.second.sideband_stream();
+      break;
+    }
+  }
+  if (handle == sideband_handle_)
+    return;
+
+  // The compositor drops the frames it hasn't shown yet, the one on screen
+  // is released to the producer once replaced
+  if (sideband_stream_)
+    sideband_stream_->Stop();
+  compositor_.ClearSidebandFrame();
+  sideband_stream_.reset();
+  sideband_handle_ = handle;
+  if (!handle)
+    return;
+
+  sideband_stream_ = importer_->OpenSidebandStream(handle);
+  if (!sideband_stream_) {
+    ALOGI("Sideband stream on display %" PRIu64 " left to client composition",
+          handle_);
+    return;
+  }
+  int ret = sideband_stream_->Start(&compositor_);
+  if (ret) {
+    ALOGE("Failed to start sideband stream %d", ret);
+    sideband_stream_.reset();
+  }
+}
+
+bool DrmHwcTwo::HwcDisplay::ShowsSideband(const HwcLayer &layer) const {
+  return layer.sf_type() == HWC2::Composition::Sideband && sideband_stream_ &&
+         layer.sideband_stream() == sideband_handle_;
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   supported(__func__);
   HWC2::Error ret;
@@ -608,10 +925,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   if (ret != HWC2::Error::None)
     return ret;
 
-  // The retire fence returned here is for the last frame, so return it and
-  // promote the next retire fence
+  // Hand out the fence of the frame just committed, not the one before it
   *retire_fence = retire_fence_.Release();
-  retire_fence_ = std::move(next_retire_fence_);
 
   ++frame_no_;
   return HWC2::Error::None;
@@ -619,29 +934,41 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
   supported(__func__);
-  auto mode = std::find_if(connector_->modes().begin(),
-                           connector_->modes().end(),
-                           [config](DrmMode const &m) {
-                             return m.id() == config;
-                           });
-  if (mode == connector_->modes().end()) {
+  std::shared_ptr<const DrmModeList> modes = connector_->modes();
+  int scale_percent;
+  const DrmMode *mode = FindConfig(*modes, config, &scale_percent);
+  if (!mode) {
     ALOGE("Could not find active mode for %d", config);
     return HWC2::Error::BadConfig;
   }
 
-  std::unique_ptr<DrmDisplayComposition> composition = compositor_
-                                                           .CreateComposition();
-  composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
-  int ret = composition->SetDisplayMode(*mode);
-  ret = compositor_.ApplyComposition(std::move(composition));
-  if (ret) {
-    ALOGE("Failed to queue dpms composition on %d", ret);
-    return HWC2::Error::BadConfig;
+  // Switching between render scales of the active mode only changes how the
+  // primary plane scales, there's no need for a modeset.
+  bool scale_only = connector_->active_mode().id() == mode->id() &&
+                    scale_percent != render_scale_percent_;
+
+  // Without a CRTC the mode is only recorded, it's set once hotplug binds
+  // one and asks for the preferred config again.
+  DrmCrtc *crtc = std::atomic_load(&pipe_)->crtc;
+  if (crtc && !scale_only) {
+    std::unique_ptr<DrmDisplayComposition> composition =
+        compositor_.CreateComposition();
+    composition->Init(drm_, crtc, importer_.get(), planner_.get(), frame_no_);
+    int ret = composition->SetDisplayMode(*mode);
+    ret = compositor_.ApplyComposition(std::move(composition));
+    if (ret) {
+      ALOGE("Failed to queue dpms composition on %d", ret);
+      return HWC2::Error::BadConfig;
+    }
   }
 
   connector_->set_active_mode(*mode);
 
-  // Setup the client layer's dimensions
+  // Setup the client layer's dimensions, it's rendered at the render size and
+  // stretched over the whole mode.
+  render_scale_percent_ = scale_percent;
+  uint32_t render_width = RenderSize(mode->h_display(), scale_percent);
+  uint32_t render_height = RenderSize(mode->v_display(), scale_percent);
   hwc_rect_t display_frame = {.left = 0,
                               .top = 0,
                               .right = static_cast<int>(mode->h_display()),
@@ -649,9 +976,13 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
   client_layer_.SetLayerDisplayFrame(display_frame);
   hwc_frect_t source_crop = {.left = 0.0f,
                              .top = 0.0f,
-                             .right = mode->h_display() + 0.0f,
-                             .bottom = mode->v_display() + 0.0f};
+                             .right = render_width + 0.0f,
+                             .bottom = render_height + 0.0f};
   client_layer_.SetLayerSourceCrop(source_crop);
+  frame_scale_x_ = render_width ? (float)mode->h_display() / render_width
+                                : 1.0f;
+  frame_scale_y_ = render_height ? (float)mode->v_display() / render_height
+                                 : 1.0f;
 
   return HWC2::Error::None;
 }
@@ -693,6 +1024,66 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetOutputBuffer(buffer_handle_t buffer,
   return unsupported(__func__, buffer, release_fence);
 }
 
+HWC2::Error DrmHwcTwo::HwcDisplay::GetReadbackBufferAttributes(
+    int32_t *format, int32_t *dataspace) {
+  supported(__func__);
+  uint32_t hal_format;
+  if (compositor_.GetReadbackFormat(&hal_format))
+    return HWC2::Error::Unsupported;
+  *format = static_cast<int32_t>(hal_format);
+  // Whatever the writeback hardware converts to, it doesn't tell
+  *dataspace = HAL_DATASPACE_UNKNOWN;
+  return HWC2::Error::None;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::SetReadbackBuffer(buffer_handle_t buffer,
+                                                     int32_t release_fence) {
+  supported(__func__);
+  UniqueFd uf(release_fence);
+  if (!buffer)
+    return HWC2::Error::BadParameter;
+  readback_buffer_ = buffer;
+  readback_release_fence_ = std::move(uf);
+  return HWC2::Error::None;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::GetReadbackBufferFence(int32_t *fence) {
+  supported(__func__);
+  // The frame presented last is one behind frame_no_
+  UniqueFd readback_fence;
+  if (readback_frame_no_ < 0 || (uint32_t)readback_frame_no_ + 1 != frame_no_ ||
+      compositor_.GetReadbackFence(readback_frame_no_, &readback_fence))
+    return HWC2::Error::NoResources;
+  *fence = readback_fence.Release();
+  return HWC2::Error::None;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::SetContentSampling(uint32_t interval_ms) {
+  supported(__func__);
+  if (compositor_.SetContentSampling(interval_ms))
+    return HWC2::Error::Unsupported;
+  return HWC2::Error::None;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::GetContentSample(int64_t *timestamp,
+                                                    uint32_t *num_bins,
+                                                    uint32_t *histograms) {
+  supported(__func__);
+  if (!histograms) {
+    *num_bins = HistogramWorker::kNumBins;
+    return HWC2::Error::None;
+  }
+  if (*num_bins < HistogramWorker::kNumBins)
+    return HWC2::Error::BadParameter;
+
+  std::vector<uint32_t> sample;
+  if (!compositor_.GetContentSample(timestamp, &sample))
+    return HWC2::Error::NoResources;
+  std::copy(sample.begin(), sample.end(), histograms);
+  *num_bins = HistogramWorker::kNumBins;
+  return HWC2::Error::None;
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
   supported(__func__);
   uint64_t dpms_value = 0;
@@ -709,9 +1100,13 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
       return HWC2::Error::Unsupported;
   };
 
+  DrmCrtc *crtc = std::atomic_load(&pipe_)->crtc;
+  if (!crtc)
+    return HWC2::Error::None;
+
   std::unique_ptr<DrmDisplayComposition> composition = compositor_
                                                            .CreateComposition();
-  composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
+  composition->Init(drm_, crtc, importer_.get(), planner_.get(), frame_no_);
   composition->SetDpmsMode(dpms_value);
   int ret = compositor_.ApplyComposition(std::move(composition));
   if (ret) {
@@ -732,7 +1127,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
   supported(__func__);
   *num_types = 0;
   *num_requests = 0;
-  size_t avail_planes = primary_planes_.size() + overlay_planes_.size();
+  ApplyPendingConfig();
+  std::shared_ptr<const Pipe> pipe = std::atomic_load(&pipe_);
+  size_t avail_planes = pipe->primary_planes.size() +
+                        pipe->overlay_planes.size();
   bool comp_failed = false;
 
   HWC2::Error ret;
@@ -740,10 +1138,20 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
     l.second.set_validated_type(HWC2::Composition::Invalid);
 
+  UpdateSidebandStream();
   ret = CreateComposition(true);
   if (ret != HWC2::Error::None)
     comp_failed = true;
 
+  // The sideband layer gets a plane of its own before any other layer, its
+  // frames are flipped onto it as they arrive.
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    if (comp_failed || !avail_planes || !ShowsSideband(l.second))
+      continue;
+    l.second.set_validated_type(HWC2::Composition::Sideband);
+    avail_planes--;
+  }
+
   std::map<uint32_t, DrmHwcTwo::HwcLayer *, std::greater<int>> z_map;
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
     if (l.second.sf_type() == HWC2::Composition::Device)
@@ -766,6 +1174,9 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
 
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
     DrmHwcTwo::HwcLayer &layer = l.second;
+    if (layer.sf_type() == HWC2::Composition::Sideband &&
+        layer.validated_type() == HWC2::Composition::Sideband)
+      continue;
     // We can only handle layers of Device type, send everything else to SF
     if (layer.sf_type() != HWC2::Composition::Device ||
         layer.validated_type() != HWC2::Composition::Device) {
@@ -773,9 +1184,166 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
       ++*num_types;
     }
   }
+
+  // The client target is placed at the z-order of the lowest client layer,
+  // it has to be clear where it covers the layers on planes below it.
+  uint32_t client_z_order = UINT32_MAX;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    if (l.second.validated_type() == HWC2::Composition::Client)
+      client_z_order = std::min(client_z_order, l.second.z_order());
+  }
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    bool clear = l.second.validated_type() != HWC2::Composition::Client &&
+                 l.second.z_order() < client_z_order &&
+                 client_z_order != UINT32_MAX;
+    l.second.set_clear_client_target(clear);
+    if (clear)
+      ++*num_requests;
+  }
+
+  uint32_t num_device_layers = 0;
+  uint32_t num_client_layers = 0;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    if (l.second.validated_type() == HWC2::Composition::Device ||
+        l.second.validated_type() == HWC2::Composition::Sideband)
+      ++num_device_layers;
+    else
+      ++num_client_layers;
+  }
+  compositor_.TraceValidatedFrame(frame_no_, num_device_layers,
+                                  num_client_layers);
+
   return *num_types ? HWC2::Error::HasChanges : HWC2::Error::None;
 }
 
+static bool IsLayerCommandValid(uint32_t command, uint32_t num_words) {
+  switch (command) {
+    case HWC2_DRM_LAYER_SELECT:
+      return num_words == 2;
+    case HWC2_DRM_LAYER_SET_BUFFER:
+      return num_words == 3;
+    case HWC2_DRM_LAYER_SET_BLEND_MODE:
+    case HWC2_DRM_LAYER_SET_COMPOSITION_TYPE:
+    case HWC2_DRM_LAYER_SET_DATASPACE:
+    case HWC2_DRM_LAYER_SET_PLANE_ALPHA:
+    case HWC2_DRM_LAYER_SET_TRANSFORM:
+    case HWC2_DRM_LAYER_SET_Z_ORDER:
+    case HWC2_DRM_LAYER_SET_FRONT_BUFFER:
+      return num_words == 1;
+    case HWC2_DRM_LAYER_SET_DISPLAY_FRAME:
+    case HWC2_DRM_LAYER_SET_SOURCE_CROP:
+      return num_words == 4;
+    case HWC2_DRM_LAYER_SET_SURFACE_DAMAGE:
+      return num_words % 4 == 0;
+    default:
+      return false;
+  }
+}
+
+static uint64_t ReadLayerCommandU64(const uint32_t *args) {
+  return args[0] | (uint64_t)args[1] << 32;
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::SetLayerStates(const uint32_t *commands,
+                                                  uint32_t num_words) {
+  supported(__func__);
+  HwcLayer *layer = NULL;
+  HWC2::Error ret = HWC2::Error::None;
+  std::vector<hwc_rect_t> rects;
+
+  const uint32_t *end = commands + num_words;
+  const uint32_t *header = commands;
+  while (header < end) {
+    uint32_t command = *header >> 16;
+    uint32_t len = *header & 0xffff;
+    const uint32_t *args = header + 1;
+    if (len > end - args) {
+      ALOGE("Layer command %u overruns the buffer", command);
+      return HWC2::Error::BadParameter;
+    }
+    header = args + len;
+
+    // Fences are ours once passed in, whatever happens to the command
+    UniqueFd fence(command == HWC2_DRM_LAYER_SET_BUFFER && len == 3
+                       ? static_cast<int32_t>(args[2])
+                       : -1);
+    if (ret != HWC2::Error::None)
+      continue;
+
+    if (!IsLayerCommandValid(command, len)) {
+      ALOGE("Bad layer command %u with %u words", command, len);
+      ret = HWC2::Error::BadParameter;
+      continue;
+    }
+
+    if (command == HWC2_DRM_LAYER_SELECT) {
+      auto it = layers_.find(ReadLayerCommandU64(args));
+      layer = it != layers_.end() ? &it->second : NULL;
+      if (!layer)
+        ret = HWC2::Error::BadLayer;
+      continue;
+    }
+    if (!layer) {
+      ret = HWC2::Error::BadLayer;
+      continue;
+    }
+
+    switch (command) {
+      case HWC2_DRM_LAYER_SET_BUFFER: {
+        uintptr_t handle = ReadLayerCommandU64(args);
+        layer->SetLayerBuffer(reinterpret_cast<buffer_handle_t>(handle),
+                              fence.Release());
+        break;
+      }
+      case HWC2_DRM_LAYER_SET_BLEND_MODE:
+        layer->SetLayerBlendMode(static_cast<int32_t>(args[0]));
+        break;
+      case HWC2_DRM_LAYER_SET_COMPOSITION_TYPE:
+        layer->SetLayerCompositionType(static_cast<int32_t>(args[0]));
+        break;
+      case HWC2_DRM_LAYER_SET_DATASPACE:
+        layer->SetLayerDataspace(static_cast<int32_t>(args[0]));
+        break;
+      case HWC2_DRM_LAYER_SET_DISPLAY_FRAME: {
+        hwc_rect_t frame;
+        memcpy(&frame, args, sizeof(frame));
+        layer->SetLayerDisplayFrame(frame);
+        break;
+      }
+      case HWC2_DRM_LAYER_SET_PLANE_ALPHA: {
+        float alpha;
+        memcpy(&alpha, args, sizeof(alpha));
+        layer->SetLayerPlaneAlpha(alpha);
+        break;
+      }
+      case HWC2_DRM_LAYER_SET_SOURCE_CROP: {
+        hwc_frect_t crop;
+        memcpy(&crop, args, sizeof(crop));
+        layer->SetLayerSourceCrop(crop);
+        break;
+      }
+      case HWC2_DRM_LAYER_SET_SURFACE_DAMAGE: {
+        rects.resize(len / 4);
+        memcpy(rects.data(), args, len * sizeof(uint32_t));
+        hwc_region_t damage = {.numRects = rects.size(),
+                               .rects = rects.data()};
+        layer->SetLayerSurfaceDamage(damage);
+        break;
+      }
+      case HWC2_DRM_LAYER_SET_TRANSFORM:
+        layer->SetLayerTransform(static_cast<int32_t>(args[0]));
+        break;
+      case HWC2_DRM_LAYER_SET_Z_ORDER:
+        layer->SetLayerZOrder(args[0]);
+        break;
+      case HWC2_DRM_LAYER_SET_FRONT_BUFFER:
+        layer->SetLayerFrontBuffer(static_cast<int32_t>(args[0]));
+        break;
+    }
+  }
+  return ret;
+}
+
 HWC2::Error DrmHwcTwo::HwcLayer::SetCursorPosition(int32_t x, int32_t y) {
   supported(__func__);
   cursor_x_ = x;
@@ -836,8 +1404,8 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerPlaneAlpha(float alpha) {
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSidebandStream(
     const native_handle_t *stream) {
   supported(__func__);
-  // TODO: We don't support sideband
-  return unsupported(__func__, stream);
+  sideband_stream_ = stream;
+  return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
@@ -848,8 +1416,7 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSurfaceDamage(hwc_region_t damage) {
   supported(__func__);
-  // TODO: We don't use surface damage, marking as unsupported
-  unsupported(__func__, damage);
+  damage_.assign(damage.rects, damage.rects + damage.numRects);
   return HWC2::Error::None;
 }
 
@@ -872,6 +1439,12 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerZOrder(uint32_t order) {
   return HWC2::Error::None;
 }
 
+HWC2::Error DrmHwcTwo::HwcLayer::SetLayerFrontBuffer(int32_t front_buffer) {
+  supported(__func__);
+  front_buffer_ = front_buffer != 0;
+  return HWC2::Error::None;
+}
+
 void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   supported(__func__);
   switch (blending_) {
@@ -896,18 +1469,28 @@ void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   layer->acquire_fence = acquire_fence_.Release();
   layer->release_fence = std::move(release_fence);
   layer->SetDisplayFrame(display_frame_);
+  layer->damage = damage_;
+  layer->front_buffer = front_buffer_;
   layer->alpha = static_cast<uint16_t>(65535.0f * alpha_ + 0.5f);
   layer->SetSourceCrop(source_crop_);
   layer->SetTransform(static_cast<int32_t>(transform_));
 }
 
 void DrmHwcTwo::HandleDisplayHotplug(hwc2_display_t displayid, int state) {
-  auto cb = callbacks_.find(HWC2::Callback::Hotplug);
-  if (cb == callbacks_.end())
-    return;
+  hwc2_callback_data_t data;
+  hwc2_function_pointer_t func;
+  {
+    std::lock_guard<std::mutex> lk(callbacks_lock_);
+    auto cb = callbacks_.find(HWC2::Callback::Hotplug);
+    if (cb == callbacks_.end())
+      return;
+    data = cb->second.data;
+    func = cb->second.func;
+  }
 
-  auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(cb->second.func);
-  hotplug(cb->second.data, displayid,
+  // Called without the lock held since SurfaceFlinger may call back into us
+  auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(func);
+  hotplug(data, displayid,
           (state == DRM_MODE_CONNECTED ? HWC2_CONNECTION_CONNECTED
                                        : HWC2_CONNECTION_DISCONNECTED));
 }
@@ -920,27 +1503,55 @@ void DrmHwcTwo::HandleInitialHotplugState(DrmDevice *drmDevice) {
   }
 }
 
-void DrmHwcTwo::DrmHotplugHandler::HandleEvent(uint64_t timestamp_us) {
+void DrmHwcTwo::DrmHotplugHandler::HandleHotplug(uint64_t timestamp_us,
+                                                  uint32_t connector_id) {
   for (auto &conn : drm_->connectors()) {
+    if (connector_id && conn->id() != connector_id)
+      continue;
+
+    // The kernel probed the connector before sending the uevent, so the
+    // current state is enough to tell whether anything changed.
     drmModeConnection old_state = conn->state();
-    drmModeConnection cur_state = conn->UpdateModes()
+    drmModeConnection cur_state = conn->UpdateState()
                                       ? DRM_MODE_UNKNOWNCONNECTION
                                       : conn->state();
 
     if (cur_state == old_state)
       continue;
 
+    // Leased displays are up to the lessee
+    DrmCrtc *crtc = drm_->GetCrtcForDisplay(conn->display());
+    if (crtc && crtc->leased())
+      continue;
+
+    // Only a newly connected monitor needs the full probe for its modes, and
+    // not even that if it's been connected before.
+    if (cur_state == DRM_MODE_CONNECTED && conn->RestoreCachedModes() &&
+        conn->UpdateModes()) {
+      ALOGE("Failed to update modes for connector %u", conn->id());
+      continue;
+    }
+
     ALOGI("%s event @%" PRIu64 " for connector %u on display %d",
           cur_state == DRM_MODE_CONNECTED ? "Plug" : "Unplug", timestamp_us,
           conn->id(), conn->display());
 
     int display_id = conn->display();
+    auto &display = hwc2_->displays_.at(display_id);
     if (cur_state == DRM_MODE_CONNECTED) {
-      auto &display = hwc2_->displays_.at(display_id);
-      display.ChosePreferredConfig();
+      if (drm_->BindDisplayPipe(conn.get())) {
+        ALOGE("No CRTC available for display %d", display_id);
+        continue;
+      }
+      display.UpdatePipe();
+      display.UpdateScaledConfigs();
+      display.RequestPreferredConfig();
     } else {
-      auto &display = hwc2_->displays_.at(display_id);
+      // Give the CRTC and its planes back to the other displays
       display.ClearDisplay();
+      drm_->ReleaseDisplayPipe(conn.get());
+      display.UpdatePipe();
+      display.UpdateScaledConfigs();
     }
 
     hwc2_->HandleDisplayHotplug(display_id, cur_state);
@@ -965,6 +1576,9 @@ void DrmHwcTwo::HookDevGetCapabilities(hwc2_device_t * /*dev*/,
 hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
     struct hwc2_device * /*dev*/, int32_t descriptor) {
   supported(__func__);
+  if (descriptor >= HWC2_DRM_FUNCTION_FIRST)
+    return GetVendorFunction(descriptor);
+
   auto func = static_cast<HWC2::FunctionDescriptor>(descriptor);
   switch (func) {
     // Device functions
@@ -1161,6 +1775,51 @@ hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
   }
 }
 
+// static
+hwc2_function_pointer_t DrmHwcTwo::GetVendorFunction(int32_t descriptor) {
+  switch (static_cast<hwc2_drm_function_descriptor_t>(descriptor)) {
+    case HWC2_DRM_FUNCTION_CREATE_LEASE:
+      return ToHook<HWC2_DRM_PFN_CREATE_LEASE>(
+          DeviceHook<int32_t, decltype(&DrmHwcTwo::CreateLease),
+                     &DrmHwcTwo::CreateLease, hwc2_display_t, int32_t *,
+                     uint32_t *>);
+    case HWC2_DRM_FUNCTION_REVOKE_LEASE:
+      return ToHook<HWC2_DRM_PFN_REVOKE_LEASE>(
+          DeviceHook<int32_t, decltype(&DrmHwcTwo::RevokeLease),
+                     &DrmHwcTwo::RevokeLease, hwc2_display_t, uint32_t>);
+    case HWC2_DRM_FUNCTION_SET_LAYER_STATES:
+      return ToHook<HWC2_DRM_PFN_SET_LAYER_STATES>(
+          DisplayHook<decltype(&HwcDisplay::SetLayerStates),
+                      &HwcDisplay::SetLayerStates, const uint32_t *,
+                      uint32_t>);
+    case HWC2_DRM_FUNCTION_GET_READBACK_BUFFER_ATTRIBUTES:
+      return ToHook<HWC2_DRM_PFN_GET_READBACK_BUFFER_ATTRIBUTES>(
+          DisplayHook<decltype(&HwcDisplay::GetReadbackBufferAttributes),
+                      &HwcDisplay::GetReadbackBufferAttributes, int32_t *,
+                      int32_t *>);
+    case HWC2_DRM_FUNCTION_SET_READBACK_BUFFER:
+      return ToHook<HWC2_DRM_PFN_SET_READBACK_BUFFER>(
+          DisplayHook<decltype(&HwcDisplay::SetReadbackBuffer),
+                      &HwcDisplay::SetReadbackBuffer, buffer_handle_t,
+                      int32_t>);
+    case HWC2_DRM_FUNCTION_GET_READBACK_BUFFER_FENCE:
+      return ToHook<HWC2_DRM_PFN_GET_READBACK_BUFFER_FENCE>(
+          DisplayHook<decltype(&HwcDisplay::GetReadbackBufferFence),
+                      &HwcDisplay::GetReadbackBufferFence, int32_t *>);
+    case HWC2_DRM_FUNCTION_SET_CONTENT_SAMPLING:
+      return ToHook<HWC2_DRM_PFN_SET_CONTENT_SAMPLING>(
+          DisplayHook<decltype(&HwcDisplay::SetContentSampling),
+                      &HwcDisplay::SetContentSampling, uint32_t>);
+    case HWC2_DRM_FUNCTION_GET_CONTENT_SAMPLE:
+      return ToHook<HWC2_DRM_PFN_GET_CONTENT_SAMPLE>(
+          DisplayHook<decltype(&HwcDisplay::GetContentSample),
+                      &HwcDisplay::GetContentSample, int64_t *, uint32_t *,
+                      uint32_t *>);
+    default:
+      return NULL;
+  }
+}
+
 // static
 int DrmHwcTwo::HookDevOpen(const struct hw_module_t *module, const char *name,
                            struct hw_device_t **dev) {
@@ -22,7 +22,13 @@
 
 #include <hardware/hwcomposer2.h>
 
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
 
 namespace android {
 
@@ -54,6 +60,15 @@ class DrmHwcTwo : public hwc2_device_t {
       return sf_type_ != validated_type_;
     }
 
+    // Device layers below the client target need it to be transparent
+    // where they are
+    bool clear_client_target() const {
+      return clear_client_target_;
+    }
+    void set_clear_client_target(bool clear) {
+      clear_client_target_ = clear;
+    }
+
     uint32_t z_order() const {
       return z_order_;
     }
@@ -65,6 +80,10 @@ class DrmHwcTwo : public hwc2_device_t {
       buffer_ = buffer;
     }
 
+    const native_handle_t *sideband_stream() const {
+      return sideband_stream_;
+    }
+
     int take_acquire_fence() {
       return acquire_fence_.Release();
     }
@@ -78,6 +97,9 @@ class DrmHwcTwo : public hwc2_device_t {
     int take_release_fence() {
       return release_fence_.Release();
     }
+    void set_release_fence(int release_fence) {
+      release_fence_.Set(release_fence);
+    }
     void manage_release_fence() {
       release_fence_.Set(release_fence_raw_);
       release_fence_raw_ = -1;
@@ -103,19 +125,23 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error SetLayerTransform(int32_t transform);
     HWC2::Error SetLayerVisibleRegion(hwc_region_t visible);
     HWC2::Error SetLayerZOrder(uint32_t z);
+    HWC2::Error SetLayerFrontBuffer(int32_t front_buffer);
 
    private:
     // sf_type_ stores the initial type given to us by surfaceflinger,
     // validated_type_ stores the type after running ValidateDisplay
     HWC2::Composition sf_type_ = HWC2::Composition::Invalid;
     HWC2::Composition validated_type_ = HWC2::Composition::Invalid;
+    bool clear_client_target_ = false;
 
     HWC2::BlendMode blending_ = HWC2::BlendMode::None;
     buffer_handle_t buffer_ = NULL;
+    const native_handle_t *sideband_stream_ = NULL;
     UniqueFd acquire_fence_;
     int release_fence_raw_ = -1;
     UniqueFd release_fence_;
     hwc_rect_t display_frame_;
+    std::vector<hwc_rect_t> damage_;
     float alpha_ = 1.0f;
     hwc_frect_t source_crop_;
     int32_t cursor_x_;
@@ -123,6 +149,7 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Transform transform_ = HWC2::Transform::None;
     uint32_t z_order_ = 0;
     android_dataspace_t dataspace_ = HAL_DATASPACE_UNKNOWN;
+    bool front_buffer_ = false;
   };
 
   struct HwcCallback {
@@ -139,11 +166,23 @@ class DrmHwcTwo : public hwc2_device_t {
                std::shared_ptr<Importer> importer, hwc2_display_t handle,
                HWC2::DisplayType type);
     HwcDisplay(const HwcDisplay &) = delete;
-    HWC2::Error Init(std::vector<DrmPlane *> *planes);
+    HWC2::Error Init();
+    // Picks up the CRTC bound to the display and the planes usable on it
+    void UpdatePipe();
+    // Runs the scaling tests of the primary plane for every mode, whenever
+    // the pipe or the modes change
+    void UpdateScaledConfigs();
+    // Has the preferred config applied by the next call SurfaceFlinger makes
+    // on the display, instead of racing it from the hotplug thread.
+    void RequestPreferredConfig();
 
     HWC2::Error RegisterVsyncCallback(hwc2_callback_data_t data,
                                       hwc2_function_pointer_t func);
     void ClearDisplay();
+    // Stops using the display's CRTC and clears the screen for a lease, then
+    // leases it. The screen is restored if that fails.
+    int CreateLease(uint32_t *lessee_id);
+    void Dump(std::ostringstream *out);
 
     // HWC Hooks
     HWC2::Error AcceptDisplayChanges();
@@ -183,12 +222,54 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error SetPowerMode(int32_t mode);
     HWC2::Error SetVsyncEnabled(int32_t enabled);
     HWC2::Error ValidateDisplay(uint32_t *num_types, uint32_t *num_requests);
-    HwcLayer &get_layer(hwc2_layer_t layer) {
-      return layers_.at(layer);
+    // Vendor hooks, see drmhwcvendor.h
+    HWC2::Error SetLayerStates(const uint32_t *commands, uint32_t num_words);
+    HWC2::Error GetReadbackBufferAttributes(int32_t *format,
+                                            int32_t *dataspace);
+    HWC2::Error SetReadbackBuffer(buffer_handle_t buffer,
+                                  int32_t release_fence);
+    HWC2::Error GetReadbackBufferFence(int32_t *fence);
+    HWC2::Error SetContentSampling(uint32_t interval_ms);
+    HWC2::Error GetContentSample(int64_t *timestamp, uint32_t *num_bins,
+                                 uint32_t *histograms);
+    HwcLayer *get_layer(hwc2_layer_t layer) {
+      auto it = layers_.find(layer);
+      return it == layers_.end() ? NULL : &it->second;
     }
 
    private:
+    // The CRTC and planes the display is composited onto. It's replaced as a
+    // whole on hotplug and read with std::atomic_load, so a frame keeps the
+    // pipe it started with and the present path never waits on hotplug.
+    struct Pipe {
+      DrmCrtc *crtc = NULL;
+      std::vector<DrmPlane *> primary_planes;
+      std::vector<DrmPlane *> overlay_planes;
+    };
+
+    // Configs are mode ids, those for rendering below the resolution of the
+    // mode carry the render scale in percent above kConfigScaleShift.
+    static const int kConfigScaleShift = 24;
+    static hwc2_config_t MakeConfig(uint32_t mode_id, int scale_percent) {
+      return mode_id |
+             (scale_percent < 100 ? scale_percent << kConfigScaleShift : 0);
+    }
+    // Size of the display SurfaceFlinger renders at
+    static uint32_t RenderSize(uint32_t size, int scale_percent) {
+      return size * scale_percent / 100;
+    }
+
+    // Finds the mode of config and puts its render scale in scale_percent,
+    // scaled configs are only found if the primary plane can scale them.
+    const DrmMode *FindConfig(const DrmModeList &modes, hwc2_config_t config,
+                              int *scale_percent);
+    bool CanScaleMode(const DrmMode &mode, int scale_percent);
+
     HWC2::Error CreateComposition(bool test);
+    // Connects to the stream of the display's sideband layer, if it has one
+    void UpdateSidebandStream();
+    bool ShowsSideband(const HwcLayer &layer) const;
+    void ApplyPendingConfig();
     void AddFenceToRetireFence(int fd);
 
     ResourceManager *resource_manager_;
@@ -197,30 +278,53 @@ class DrmHwcTwo : public hwc2_device_t {
     std::shared_ptr<Importer> importer_;
     std::unique_ptr<Planner> planner_;
 
-    std::vector<DrmPlane *> primary_planes_;
-    std::vector<DrmPlane *> overlay_planes_;
+    // Only a single sideband layer per display is flipped directly, the
+    // stream is declared after compositor_ so it stops delivering first.
+    const native_handle_t *sideband_handle_ = NULL;
+    std::unique_ptr<SidebandStream> sideband_stream_;
+
+    std::shared_ptr<const Pipe> pipe_;
+    bool use_overlay_planes_ = true;
+
+    // Under thermal or battery pressure SurfaceFlinger can switch to a
+    // config rendering at one of these scales, which the primary plane
+    // stretches back over the mode.
+    static const int kMinRenderScalePercent = 25;
+    std::vector<int> render_scales_;
+    // Scaled configs the primary plane passed a test commit of, they're
+    // dropped whenever the pipe changes until the tests run again
+    std::mutex scaled_configs_lock_;
+    std::set<hwc2_config_t> scaled_configs_;
+    int render_scale_percent_ = 100;
+    // From the size SurfaceFlinger renders at to the size of the active mode
+    float frame_scale_x_ = 1.0f;
+    float frame_scale_y_ = 1.0f;
+    std::atomic<bool> preferred_config_pending_{false};
 
     VSyncWorker vsync_worker_;
     DrmConnector *connector_ = NULL;
-    DrmCrtc *crtc_ = NULL;
     hwc2_display_t handle_;
     HWC2::DisplayType type_;
     uint32_t layer_idx_ = 0;
     std::map<hwc2_layer_t, HwcLayer> layers_;
     HwcLayer client_layer_;
     UniqueFd retire_fence_;
-    UniqueFd next_retire_fence_;
     int32_t color_mode_;
 
+    // Readback set for the next frame, and the frame last read back
+    buffer_handle_t readback_buffer_ = NULL;
+    UniqueFd readback_release_fence_;
+    int64_t readback_frame_no_ = -1;
+
     uint32_t frame_no_ = 0;
   };
 
-  class DrmHotplugHandler : public DrmEventHandler {
+  class DrmHotplugHandler : public DrmHotplugEventHandler {
    public:
     DrmHotplugHandler(DrmHwcTwo *hwc2, DrmDevice *drm)
         : hwc2_(hwc2), drm_(drm) {
     }
-    void HandleEvent(uint64_t timestamp_us);
+    void HandleHotplug(uint64_t timestamp_us, uint32_t connector_id) override;
 
    private:
     DrmHwcTwo *hwc2_;
@@ -247,7 +351,10 @@ class DrmHwcTwo : public hwc2_device_t {
   static int32_t DisplayHook(hwc2_device_t *dev, hwc2_display_t display_handle,
                              Args... args) {
     DrmHwcTwo *hwc = toDrmHwcTwo(dev);
-    HwcDisplay &display = hwc->displays_.at(display_handle);
+    auto it = hwc->displays_.find(display_handle);
+    if (it == hwc->displays_.end())
+      return static_cast<int32_t>(HWC2::Error::BadDisplay);
+    HwcDisplay &display = it->second;
     return static_cast<int32_t>((display.*func)(std::forward<Args>(args)...));
   }
 
@@ -255,9 +362,13 @@ class DrmHwcTwo : public hwc2_device_t {
   static int32_t LayerHook(hwc2_device_t *dev, hwc2_display_t display_handle,
                            hwc2_layer_t layer_handle, Args... args) {
     DrmHwcTwo *hwc = toDrmHwcTwo(dev);
-    HwcDisplay &display = hwc->displays_.at(display_handle);
-    HwcLayer &layer = display.get_layer(layer_handle);
-    return static_cast<int32_t>((layer.*func)(std::forward<Args>(args)...));
+    auto it = hwc->displays_.find(display_handle);
+    if (it == hwc->displays_.end())
+      return static_cast<int32_t>(HWC2::Error::BadDisplay);
+    HwcLayer *layer = it->second.get_layer(layer_handle);
+    if (!layer)
+      return static_cast<int32_t>(HWC2::Error::BadLayer);
+    return static_cast<int32_t>((layer->*func)(std::forward<Args>(args)...));
   }
 
   // hwc2_device_t hooks
@@ -275,12 +386,28 @@ class DrmHwcTwo : public hwc2_device_t {
   uint32_t GetMaxVirtualDisplayCount();
   HWC2::Error RegisterCallback(int32_t descriptor, hwc2_callback_data_t data,
                                hwc2_function_pointer_t function);
+
+  // Vendor functions, see drmhwcvendor.h
+  static hwc2_function_pointer_t GetVendorFunction(int32_t descriptor);
+  HWC2::Error CreateLease(hwc2_display_t display, int32_t *out_lease_fd,
+                          uint32_t *out_lessee_id);
+  HWC2::Error RevokeLease(hwc2_display_t display, uint32_t lessee_id);
+  // Has every display on the device pick up the CRTCs and planes it may use
+  void UpdatePipes(DrmDevice *drm);
   HWC2::Error CreateDisplay(hwc2_display_t displ, HWC2::DisplayType type);
   void HandleDisplayHotplug(hwc2_display_t displayid, int state);
   void HandleInitialHotplugState(DrmDevice *drmDevice);
 
   ResourceManager resource_manager_;
+  // Every display is created in Init() and the map isn't modified after that,
+  // so it can be looked up from any thread without locking. Hotplug only
+  // changes the state within a display.
   std::map<hwc2_display_t, HwcDisplay> displays_;
+  // Written by SurfaceFlinger, read from the hotplug thread
+  std::mutex callbacks_lock_;
   std::map<HWC2::Callback, HwcCallback> callbacks_;
+
+  // Dump() is called twice, once for the size and once for the contents
+  std::string dump_string_;
 };
 }  // namespace android
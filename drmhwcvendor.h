@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_HWC_VENDOR_H_
+#define ANDROID_DRM_HWC_VENDOR_H_
+
+#include <stdint.h>
+
+#include <hardware/hwcomposer2.h>
+
+/*
+ * Functions drm_hwcomposer offers on top of HWC2. They're looked up with
+ * getFunction like the standard ones, using descriptors outside of the range
+ * HWC2 uses, and return hwc2_error_t values.
+ */
+typedef enum {
+  HWC2_DRM_FUNCTION_FIRST = 0x1000,
+
+  /*
+   * Leases the connector of a display, a CRTC and the planes usable on it to
+   * the caller, which drives it with its own atomic commits on the returned
+   * DRM fd. The display is reported as disconnected for as long as the lease
+   * lasts.
+   */
+  HWC2_DRM_FUNCTION_CREATE_LEASE = HWC2_DRM_FUNCTION_FIRST,
+  HWC2_DRM_FUNCTION_REVOKE_LEASE,
+
+  /*
+   * Sets the state of any number of layers of a display from a buffer of
+   * packed commands, see hwc2_drm_layer_command_t, instead of a call per
+   * layer and attribute.
+   */
+  HWC2_DRM_FUNCTION_SET_LAYER_STATES,
+
+  /*
+   * Reads back the frame presented by the next presentDisplay into a buffer,
+   * with writeback instead of a GPU composition. The buffer must be
+   * allocated with the format the attributes report.
+   */
+  HWC2_DRM_FUNCTION_GET_READBACK_BUFFER_ATTRIBUTES,
+  HWC2_DRM_FUNCTION_SET_READBACK_BUFFER,
+  HWC2_DRM_FUNCTION_GET_READBACK_BUFFER_FENCE,
+
+  /*
+   * Samples what a display shows at a fixed rate, as histograms of its red,
+   * green and blue channels computed from frames read back with writeback.
+   */
+  HWC2_DRM_FUNCTION_SET_CONTENT_SAMPLING,
+  HWC2_DRM_FUNCTION_GET_CONTENT_SAMPLE,
+} hwc2_drm_function_descriptor_t;
+
+/*
+ * Each command is a header word built with HWC2_DRM_LAYER_COMMAND, holding
+ * the command and the number of 32 bit words of arguments following it.
+ * Arguments are laid out like the parameters of the equivalent HWC2 layer
+ * function, 64 bit values with their low word first. Commands apply to the
+ * layer last selected with HWC2_DRM_LAYER_SELECT.
+ */
+typedef enum {
+  HWC2_DRM_LAYER_SELECT = 1,            /* hwc2_layer_t */
+  HWC2_DRM_LAYER_SET_BUFFER,            /* buffer_handle_t, int32_t fence */
+  HWC2_DRM_LAYER_SET_BLEND_MODE,        /* int32_t */
+  HWC2_DRM_LAYER_SET_COMPOSITION_TYPE,  /* int32_t */
+  HWC2_DRM_LAYER_SET_DATASPACE,         /* int32_t */
+  HWC2_DRM_LAYER_SET_DISPLAY_FRAME,     /* hwc_rect_t */
+  HWC2_DRM_LAYER_SET_PLANE_ALPHA,       /* float */
+  HWC2_DRM_LAYER_SET_SOURCE_CROP,       /* hwc_frect_t */
+  HWC2_DRM_LAYER_SET_SURFACE_DAMAGE,    /* hwc_rect_t[] */
+  HWC2_DRM_LAYER_SET_TRANSFORM,         /* int32_t */
+  HWC2_DRM_LAYER_SET_Z_ORDER,           /* uint32_t */
+  /*
+   * Marks the buffer of the layer as rendered to in place while it's shown,
+   * presenting it again then only passes its damage on to the display.
+   */
+  HWC2_DRM_LAYER_SET_FRONT_BUFFER,      /* int32_t */
+} hwc2_drm_layer_command_t;
+
+#define HWC2_DRM_LAYER_COMMAND(command, num_words) \
+  (((uint32_t)(command) << 16) | ((uint32_t)(num_words)&0xffff))
+
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_CREATE_LEASE)(
+    hwc2_device_t *device, hwc2_display_t display, int32_t *out_lease_fd,
+    uint32_t *out_lessee_id);
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_REVOKE_LEASE)(
+    hwc2_device_t *device, hwc2_display_t display, uint32_t lessee_id);
+
+/*
+ * Commands up to the first bad one are applied. The acquire fences of every
+ * HWC2_DRM_LAYER_SET_BUFFER command are taken over, even if it's not.
+ */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_SET_LAYER_STATES)(
+    hwc2_device_t *device, hwc2_display_t display, const uint32_t *commands,
+    uint32_t num_words);
+
+/*
+ * Fails with HWC2_ERROR_UNSUPPORTED if the display can't be read back.
+ */
+typedef int32_t /*hwc2_error_t*/ (
+    *HWC2_DRM_PFN_GET_READBACK_BUFFER_ATTRIBUTES)(
+    hwc2_device_t *device, hwc2_display_t display, int32_t *out_format,
+    int32_t *out_dataspace);
+
+/*
+ * The release fence is waited on before the buffer is written to.
+ */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_SET_READBACK_BUFFER)(
+    hwc2_device_t *device, hwc2_display_t display, buffer_handle_t buffer,
+    int32_t release_fence);
+
+/*
+ * Called after presentDisplay. Fails with HWC2_ERROR_NO_RESOURCES if that
+ * frame couldn't be read back, or hasn't been committed yet because it's
+ * waiting on fences.
+ */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_GET_READBACK_BUFFER_FENCE)(
+    hwc2_device_t *device, hwc2_display_t display, int32_t *out_fence);
+
+/*
+ * A frame is sampled every interval_ms at most, 0 stops sampling. Fails with
+ * HWC2_ERROR_UNSUPPORTED if the display can't be read back.
+ */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_SET_CONTENT_SAMPLING)(
+    hwc2_device_t *device, hwc2_display_t display, uint32_t interval_ms);
+
+/*
+ * Copies the latest sample into out_histograms, the out_num_bins bins of the
+ * red channel followed by those of green and blue. The number of bins is
+ * queried with a NULL out_histograms. out_timestamp is the CLOCK_MONOTONIC
+ * time the frame was committed at. Fails with HWC2_ERROR_NO_RESOURCES if
+ * there's no sample yet.
+ */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_DRM_PFN_GET_CONTENT_SAMPLE)(
+    hwc2_device_t *device, hwc2_display_t display, int64_t *out_timestamp,
+    uint32_t *out_num_bins, uint32_t *out_histograms);
+
+#endif  // ANDROID_DRM_HWC_VENDOR_H_
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-ioctl-watchdog"
+
+#include "drmioctlwatchdog.h"
+#include "drmhwcomposer.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+#include <log/log.h>
+
+namespace android {
+
+static const int64_t kOneMillisecondNs = 1000 * 1000;
+
+// The display and frame the current thread is issuing ioctls for
+static thread_local int context_display = -1;
+static thread_local uint64_t context_frame_no = 0;
+
+static const char *IoctlName(DrmIoctlWatchdog::Ioctl ioctl) {
+  switch (ioctl) {
+    case DrmIoctlWatchdog::kAtomicCommit:
+      return "atomic_commit";
+    case DrmIoctlWatchdog::kAddFb:
+      return "addfb2";
+    case DrmIoctlWatchdog::kPrimeImport:
+      return "prime_import";
+    case DrmIoctlWatchdog::kWaitVBlank:
+      return "wait_vblank";
+    default:
+      return "unknown";
+  }
+}
+
+static int64_t GetThresholdNs(const char *prop, const char *default_ms) {
+  char value[PROPERTY_VALUE_MAX];
+  property_get(prop, value, default_ms);
+  return strtoll(value, NULL, 10) * kOneMillisecondNs;
+}
+
+DrmIoctlWatchdog::FrameContext::FrameContext(int display, uint64_t frame_no)
+    : old_display_(context_display), old_frame_no_(context_frame_no) {
+  context_display = display;
+  context_frame_no = frame_no;
+}
+
+DrmIoctlWatchdog::FrameContext::~FrameContext() {
+  context_display = old_display_;
+  context_frame_no = old_frame_no_;
+}
+
+DrmIoctlWatchdog::Scope::Scope(DrmIoctlWatchdog *watchdog, Ioctl ioctl)
+    : watchdog_(watchdog), id_(0) {
+  if (watchdog_ && watchdog_->initialized())
+    id_ = watchdog_->Begin(ioctl);
+}
+
+DrmIoctlWatchdog::Scope::~Scope() {
+  if (id_)
+    watchdog_->End(id_);
+}
+
+DrmIoctlWatchdog::DrmIoctlWatchdog()
+    : Worker("drm-ioctl-watchdog", HAL_PRIORITY_URGENT_DISPLAY),
+      stuck_threshold_ns_(0),
+      next_id_(1) {
+  for (int i = 0; i < kNumIoctls; ++i)
+    slow_threshold_ns_[i] = 0;
+}
+
+DrmIoctlWatchdog::~DrmIoctlWatchdog() {
+}
+
+int DrmIoctlWatchdog::Init() {
+  slow_threshold_ns_[kAtomicCommit] =
+      GetThresholdNs("hwc.drm.watchdog.commit_ms", "50");
+  slow_threshold_ns_[kAddFb] = GetThresholdNs("hwc.drm.watchdog.import_ms",
+                                              "5");
+  slow_threshold_ns_[kPrimeImport] = slow_threshold_ns_[kAddFb];
+  slow_threshold_ns_[kWaitVBlank] =
+      GetThresholdNs("hwc.drm.watchdog.vblank_ms", "50");
+  stuck_threshold_ns_ = GetThresholdNs("hwc.drm.watchdog.stuck_ms", "1000");
+
+  return InitWorker();
+}
+
+uint64_t DrmIoctlWatchdog::Begin(Ioctl ioctl) {
+  Pending pending = {.ioctl = ioctl,
+                     .display = context_display,
+                     .frame_no = context_frame_no,
+                     .start_ns = GetMonotonicNs(),
+                     .reported = false};
+
+  Lock();
+  uint64_t id = next_id_++;
+  bool was_idle = pending_.empty();
+  pending_.emplace(id, pending);
+  Unlock();
+
+  // The worker sleeps indefinitely while there's nothing to watch
+  if (was_idle)
+    Signal();
+  return id;
+}
+
+void DrmIoctlWatchdog::End(uint64_t id) {
+  int64_t end_ns = GetMonotonicNs();
+
+  Lock();
+  auto it = pending_.find(id);
+  if (it == pending_.end()) {
+    Unlock();
+    return;
+  }
+  Pending pending = it->second;
+  pending_.erase(it);
+
+  int64_t duration_ns = end_ns - pending.start_ns;
+  Stats &stats = stats_[pending.ioctl];
+  ++stats.count;
+  stats.total_ns += duration_ns;
+  stats.max_ns = std::max(stats.max_ns, duration_ns);
+
+  bool slow = duration_ns > slow_threshold_ns_[pending.ioctl];
+  if (slow) {
+    ++stats.slow;
+    slow_records_.push_back({.ioctl = pending.ioctl,
+                             .display = pending.display,
+                             .frame_no = pending.frame_no,
+                             .duration_ns = duration_ns});
+    if (slow_records_.size() > kMaxSlowRecords)
+      slow_records_.pop_front();
+  }
+  Unlock();
+
+  if (slow)
+    ALOGW("Slow %s on display %d frame %" PRIu64 " took %" PRId64 "us",
+          IoctlName(pending.ioctl), pending.display, pending.frame_no,
+          duration_ns / 1000);
+}
+
+void DrmIoctlWatchdog::Routine() {
+  Lock();
+  int ret = WaitForSignalOrExitLocked(pending_.empty() ? -1
+                                                        : stuck_threshold_ns_ /
+                                                              2);
+  if (ret == -EINTR) {
+    Unlock();
+    return;
+  }
+
+  int64_t now = GetMonotonicNs();
+  for (std::pair<const uint64_t, Pending> &p : pending_) {
+    Pending &pending = p.second;
+    if (pending.reported || now - pending.start_ns < stuck_threshold_ns_)
+      continue;
+
+    pending.reported = true;
+    ++stats_[pending.ioctl].stuck;
+    ALOGE("%s on display %d frame %" PRIu64 " blocked for %" PRId64 "ms",
+          IoctlName(pending.ioctl), pending.display, pending.frame_no,
+          (now - pending.start_ns) / kOneMillisecondNs);
+  }
+  Unlock();
+}
+
+void DrmIoctlWatchdog::Dump(std::ostringstream *out) {
+  int64_t now = GetMonotonicNs();
+
+  Lock();
+  *out << "--DrmIoctlWatchdog: stuck_ms="
+       << stuck_threshold_ns_ / kOneMillisecondNs << "\n";
+  for (int i = 0; i < kNumIoctls; ++i) {
+    const Stats &stats = stats_[i];
+    *out << "    " << IoctlName((Ioctl)i)
+         << ": threshold_ms=" << slow_threshold_ns_[i] / kOneMillisecondNs
+         << " count=" << stats.count << " slow=" << stats.slow
+         << " stuck=" << stats.stuck << " max_us=" << stats.max_ns / 1000
+         << " avg_us="
+         << (stats.count ? stats.total_ns / (int64_t)stats.count / 1000 : 0)
+         << "\n";
+  }
+
+  for (const std::pair<const uint64_t, Pending> &p : pending_) {
+    const Pending &pending = p.second;
+    *out << "    in flight: " << IoctlName(pending.ioctl)
+         << " display=" << pending.display << " frame=" << pending.frame_no
+         << " elapsed_us=" << (now - pending.start_ns) / 1000 << "\n";
+  }
+
+  for (const SlowRecord &record : slow_records_) {
+    *out << "    slow: " << IoctlName(record.ioctl)
+         << " display=" << record.display << " frame=" << record.frame_no
+         << " duration_us=" << record.duration_ns / 1000 << "\n";
+  }
+  Unlock();
+}
+}  // namespace android
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_IOCTL_WATCHDOG_H_
+#define ANDROID_DRM_IOCTL_WATCHDOG_H_
+
+#include "worker.h"
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <sstream>
+
+namespace android {
+
+// Keeps track of the ioctls issued on the present path. Every ioctl that
+// takes longer than its threshold is logged along with the composition that
+// issued it, and ioctls which don't return at all are reported by the worker
+// thread while they're still blocked.
+class DrmIoctlWatchdog : public Worker {
+ public:
+  enum Ioctl {
+    kAtomicCommit = 0,
+    kAddFb,
+    kPrimeImport,
+    kWaitVBlank,
+    kNumIoctls,
+  };
+
+  // Tags the ioctls issued by the calling thread while in scope with the
+  // display and frame they're done on behalf of.
+  class FrameContext {
+   public:
+    FrameContext(int display, uint64_t frame_no);
+    ~FrameContext();
+
+   private:
+    int old_display_;
+    uint64_t old_frame_no_;
+  };
+
+  // Times a single ioctl for as long as it's in scope
+  class Scope {
+   public:
+    Scope(DrmIoctlWatchdog *watchdog, Ioctl ioctl);
+    ~Scope();
+
+   private:
+    DrmIoctlWatchdog *watchdog_;
+    uint64_t id_;
+  };
+
+  DrmIoctlWatchdog();
+  ~DrmIoctlWatchdog() override;
+
+  int Init();
+  void Dump(std::ostringstream *out);
+
+ protected:
+  void Routine() override;
+
+ private:
+  struct Pending {
+    Ioctl ioctl;
+    int display;
+    uint64_t frame_no;
+    int64_t start_ns;
+    bool reported;
+  };
+
+  struct Stats {
+    uint64_t count = 0;
+    uint64_t slow = 0;
+    uint64_t stuck = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+  };
+
+  struct SlowRecord {
+    Ioctl ioctl;
+    int display;
+    uint64_t frame_no;
+    int64_t duration_ns;
+  };
+
+  static const size_t kMaxSlowRecords = 16;
+
+  uint64_t Begin(Ioctl ioctl);
+  void End(uint64_t id);
+
+  int64_t slow_threshold_ns_[kNumIoctls];
+  int64_t stuck_threshold_ns_;
+
+  uint64_t next_id_;
+  std::map<uint64_t, Pending> pending_;
+  Stats stats_[kNumIoctls];
+  std::deque<SlowRecord> slow_records_;
+};
+}  // namespace android
+
+#endif  // ANDROID_DRM_IOCTL_WATCHDOG_H_
@@ -21,15 +21,21 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <algorithm>
 #include <cinttypes>
 
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
 #include <log/log.h>
 #include <xf86drmMode.h>
 
 namespace android {
 
 DrmPlane::DrmPlane(DrmDevice *drm, drmModePlanePtr p)
-    : drm_(drm), id_(p->plane_id), possible_crtc_mask_(p->possible_crtcs) {
+    : drm_(drm),
+      id_(p->plane_id),
+      possible_crtc_mask_(p->possible_crtcs),
+      formats_(p->formats, p->formats + p->count_formats) {
 }
 
 int DrmPlane::Init() {
@@ -138,9 +144,51 @@ int DrmPlane::Init() {
   if (ret)
     ALOGI("Could not get IN_FENCE_FD property");
 
+  ret = drm_->GetPlaneProperty(*this, "FB_DAMAGE_CLIPS",
+                               &fb_damage_clips_property_);
+  if (ret)
+    ALOGI("Could not get FB_DAMAGE_CLIPS property");
+
+  DrmProperty in_formats;
+  ret = drm_->GetPlaneProperty(*this, "IN_FORMATS", &in_formats);
+  if (!ret) {
+    uint64_t blob_id;
+    std::tie(ret, blob_id) = in_formats.value();
+    if (!ret && blob_id)
+      ParseInFormats(blob_id);
+  }
+
   return 0;
 }
 
+void DrmPlane::ParseInFormats(uint32_t blob_id) {
+  drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_->fd(), blob_id);
+  if (!blob) {
+    ALOGW("Failed to get IN_FORMATS of plane %d", id_);
+    return;
+  }
+
+  const char *data = (const char *)blob->data;
+  const drm_format_modifier_blob *header =
+      (const drm_format_modifier_blob *)data;
+  const uint32_t *formats = (const uint32_t *)(data + header->formats_offset);
+  const drm_format_modifier *modifiers =
+      (const drm_format_modifier *)(data + header->modifiers_offset);
+
+  // Each modifier lists the formats it applies to as a bitmask over the 64
+  // formats starting at offset
+  for (uint32_t i = 0; i < header->count_modifiers; ++i) {
+    for (uint32_t bit = 0; bit < 64; ++bit) {
+      uint32_t index = modifiers[i].offset + bit;
+      if (!(modifiers[i].formats & (1ULL << bit)) ||
+          index >= header->count_formats)
+        continue;
+      format_modifiers_.emplace_back(formats[index], modifiers[i].modifier);
+    }
+  }
+  drmModeFreePropertyBlob(blob);
+}
+
 uint32_t DrmPlane::id() const {
   return id_;
 }
@@ -153,6 +201,18 @@ uint32_t DrmPlane::type() const {
   return type_;
 }
 
+bool DrmPlane::IsFormatSupported(uint32_t format) const {
+  return std::find(formats_.begin(), formats_.end(), format) != formats_.end();
+}
+
+bool DrmPlane::IsFormatSupported(uint32_t format, uint64_t modifier) const {
+  if (format_modifiers_.empty())
+    return modifier == DRM_FORMAT_MOD_LINEAR && IsFormatSupported(format);
+  return std::find(format_modifiers_.begin(), format_modifiers_.end(),
+                   std::make_pair(format, modifier)) !=
+         format_modifiers_.end();
+}
+
 const DrmProperty &DrmPlane::crtc_property() const {
   return crtc_property_;
 }
@@ -212,4 +272,8 @@ const DrmProperty &DrmPlane::blend_property() const {
 const DrmProperty &DrmPlane::in_fence_fd_property() const {
   return in_fence_fd_property_;
 }
+
+const DrmProperty &DrmPlane::fb_damage_clips_property() const {
+  return fb_damage_clips_property_;
+}
 }  // namespace android
@@ -22,6 +22,8 @@
 
 #include <stdint.h>
 #include <xf86drmMode.h>
+#include <atomic>
+#include <utility>
 #include <vector>
 
 namespace android {
@@ -42,6 +44,19 @@ class DrmPlane {
 
   uint32_t type() const;
 
+  // Whether the plane scans out format at all, or with the given modifier.
+  // Without IN_FORMATS only linear buffers are assumed to work.
+  bool IsFormatSupported(uint32_t format) const;
+  bool IsFormatSupported(uint32_t format, uint64_t modifier) const;
+
+  // Leased planes belong to another DRM master and can't be composited on
+  bool leased() const {
+    return leased_;
+  }
+  void set_leased(bool leased) {
+    leased_ = leased;
+  }
+
   const DrmProperty &crtc_property() const;
   const DrmProperty &fb_property() const;
   const DrmProperty &crtc_x_property() const;
@@ -57,15 +72,23 @@ class DrmPlane {
   const DrmProperty &alpha_property() const;
   const DrmProperty &blend_property() const;
   const DrmProperty &in_fence_fd_property() const;
+  const DrmProperty &fb_damage_clips_property() const;
 
  private:
   DrmDevice *drm_;
   uint32_t id_;
 
   uint32_t possible_crtc_mask_;
+  // Read by the present path without any lock
+  std::atomic<bool> leased_{false};
 
   uint32_t type_;
 
+  void ParseInFormats(uint32_t blob_id);
+
+  std::vector<uint32_t> formats_;
+  std::vector<std::pair<uint32_t, uint64_t>> format_modifiers_;
+
   DrmProperty crtc_property_;
   DrmProperty fb_property_;
   DrmProperty crtc_x_property_;
@@ -81,6 +104,7 @@ class DrmPlane {
   DrmProperty alpha_property_;
   DrmProperty blend_property_;
   DrmProperty in_fence_fd_property_;
+  DrmProperty fb_damage_clips_property_;
 };
 }  // namespace android
 
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-syncobj"
+
+#include "drmsyncobj.h"
+#include "drmdevice.h"
+
+#include <errno.h>
+#include <time.h>
+#include <xf86drm.h>
+
+#include <log/log.h>
+
+namespace android {
+
+DrmSyncobjTimeline::DrmSyncobjTimeline()
+    : drm_(NULL), handle_(0), import_handle_(0), last_point_(0) {
+}
+
+DrmSyncobjTimeline::~DrmSyncobjTimeline() {
+  if (import_handle_)
+    drmSyncobjDestroy(drm_->fd(), import_handle_);
+  if (handle_)
+    drmSyncobjDestroy(drm_->fd(), handle_);
+}
+
+int DrmSyncobjTimeline::Init(DrmDevice *drm) {
+  drm_ = drm;
+
+  uint64_t cap = 0;
+  int ret = drmGetCap(drm_->fd(), DRM_CAP_SYNCOBJ_TIMELINE, &cap);
+  if (ret || !cap)
+    return -EOPNOTSUPP;
+
+  uint32_t handle;
+  ret = drmSyncobjCreate(drm_->fd(), 0, &handle);
+  if (ret) {
+    ALOGE("Failed to create syncobj timeline %d", ret);
+    return ret;
+  }
+  ret = drmSyncobjCreate(drm_->fd(), 0, &import_handle_);
+  if (ret) {
+    ALOGE("Failed to create syncobj for imports %d", ret);
+    drmSyncobjDestroy(drm_->fd(), handle);
+    import_handle_ = 0;
+    return ret;
+  }
+  handle_ = handle;
+  return 0;
+}
+
+int DrmSyncobjTimeline::Import(int sync_file_fd, uint64_t *point) {
+  std::lock_guard<std::mutex> lk(lock_);
+  int ret = drmSyncobjImportSyncFile(drm_->fd(), import_handle_, sync_file_fd);
+  if (ret)
+    return ret;
+
+  ret = drmSyncobjTransfer(drm_->fd(), handle_, last_point_ + 1,
+                           import_handle_, 0, 0);
+  if (ret)
+    return ret;
+
+  *point = ++last_point_;
+  return 0;
+}
+
+int DrmSyncobjTimeline::Wait(uint64_t point, int timeout_ms) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return -errno;
+  int64_t deadline_ns = (int64_t)ts.tv_sec * 1000 * 1000 * 1000 +
+                        ts.tv_nsec + (int64_t)timeout_ms * 1000 * 1000;
+
+  uint32_t handle = handle_;
+  return drmSyncobjTimelineWait(drm_->fd(), &handle, &point, 1, deadline_ns,
+                                DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL |
+                                    DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT,
+                                NULL);
+}
+}  // namespace android
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_SYNCOBJ_H_
+#define ANDROID_DRM_SYNCOBJ_H_
+
+#include <stdint.h>
+#include <mutex>
+
+namespace android {
+
+class DrmDevice;
+
+// A DRM syncobj timeline fences are attached to one point after the other.
+// Waiting for a point waits for every fence up to it, so a set of fences can
+// be waited on at once without merging sync_files into new ones.
+class DrmSyncobjTimeline {
+ public:
+  DrmSyncobjTimeline();
+  DrmSyncobjTimeline(const DrmSyncobjTimeline &) = delete;
+  ~DrmSyncobjTimeline();
+
+  // Fails if the driver doesn't support syncobj timelines
+  int Init(DrmDevice *drm);
+  bool initialized() const {
+    return handle_ != 0;
+  }
+
+  // Attaches the fence of sync_file_fd to the next point, which is stored in
+  // point. The fd is left open.
+  int Import(int sync_file_fd, uint64_t *point);
+  // Waits up to timeout_ms for the fences up to point to signal
+  int Wait(uint64_t point, int timeout_ms);
+
+ private:
+  DrmDevice *drm_;
+  uint32_t handle_;
+  // Binary syncobj sync_files are imported into before being moved onto
+  // the timeline
+  uint32_t import_handle_;
+
+  std::mutex lock_;
+  uint64_t last_point_;
+};
+}  // namespace android
+
+#endif  // ANDROID_DRM_SYNCOBJ_H_
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-fence-worker"
+
+#include "fenceworker.h"
+#include "drmdisplaycompositor.h"
+
+#include <errno.h>
+#include <inttypes.h>
+
+#include <hardware/hardware.h>
+#include <log/log.h>
+#include <sync/sync.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+FenceWorker::FenceWorker()
+    : Worker("fence", HAL_PRIORITY_URGENT_DISPLAY),
+      compositor_(NULL),
+      display_(-1),
+      timeline_(NULL),
+      waiting_(false) {
+}
+
+FenceWorker::~FenceWorker() {
+}
+
+int FenceWorker::Init(DrmDisplayCompositor *compositor, int display,
+                      DrmSyncobjTimeline *timeline) {
+  compositor_ = compositor;
+  display_ = display;
+  timeline_ = timeline;
+
+  return InitWorker(display);
+}
+
+void FenceWorker::Queue(std::unique_ptr<DrmDisplayComposition> composition,
+                        int fence, uint64_t point) {
+  Lock();
+  frames_.push_back({.composition = std::move(composition),
+                     .fence = fence,
+                     .point = point});
+  Unlock();
+  Signal();
+}
+
+bool FenceWorker::Busy() {
+  Lock();
+  bool busy = waiting_ || !frames_.empty();
+  Unlock();
+  return busy;
+}
+
+void FenceWorker::Clear() {
+  Lock();
+  frames_.clear();
+  Unlock();
+}
+
+int FenceWorker::WaitFrame(const Frame &frame) {
+  ATRACE_CALL();
+  if (frame.point && timeline_) {
+    int ret = timeline_->Wait(frame.point, kWaitTimeoutMs);
+    if (ret)
+      return ret;
+  }
+  if (frame.fence.get() >= 0)
+    return sync_wait(frame.fence.get(), kWaitTimeoutMs);
+  return 0;
+}
+
+void FenceWorker::Routine() {
+  Lock();
+  if (frames_.empty()) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || frames_.empty()) {
+      Unlock();
+      return;
+    }
+  }
+  Frame frame = std::move(frames_.front());
+  frames_.pop_front();
+  waiting_ = true;
+  Unlock();
+
+  int ret = 0;
+  for (int i = 0; i < kWaitTries && !should_exit(); ++i) {
+    ret = WaitFrame(frame);
+    if (!ret)
+      break;
+    ALOGW("Acquire fences of display %d frame %" PRIu64
+          " not signaled after %dms",
+          display_, frame.composition->frame_no(), (i + 1) * kWaitTimeoutMs);
+  }
+
+  if (ret)
+    ALOGE("Dropping display %d frame %" PRIu64 ", acquire fences failed %d",
+          display_, frame.composition->frame_no(), ret);
+  if (!should_exit())
+    compositor_->ApplyFencedComposition(std::move(frame.composition), ret);
+
+  Lock();
+  waiting_ = false;
+  Unlock();
+}
+}  // namespace android
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ANDROID_FENCE_WORKER_H_
+#define ANDROID_FENCE_WORKER_H_
+
+#include "autofd.h"
+#include "drmdisplaycomposition.h"
+#include "drmsyncobj.h"
+#include "worker.h"
+
+#include <deque>
+#include <memory>
+
+namespace android {
+
+class DrmDisplayCompositor;
+
+// Holds back frames whose acquire fences have to be waited on in userspace,
+// because the planes they're shown on can't take an IN_FENCE_FD. Frames are
+// handed back to the compositor in order once their fences signal, so the
+// thread that queued them never waits.
+class FenceWorker : public Worker {
+ public:
+  FenceWorker();
+  ~FenceWorker() override;
+
+  // timeline may be NULL if the driver has no syncobj timelines
+  int Init(DrmDisplayCompositor *compositor, int display,
+           DrmSyncobjTimeline *timeline);
+
+  // The composition is ready once fence and the fences up to point on the
+  // timeline have signaled. Takes ownership of fence, either may be unset.
+  void Queue(std::unique_ptr<DrmDisplayComposition> composition, int fence,
+             uint64_t point);
+  // Whether there are frames that have yet to be handed back, later frames
+  // must be queued behind them.
+  bool Busy();
+  // Drops the frames that are still waiting
+  void Clear();
+
+ protected:
+  void Routine() override;
+
+ private:
+  struct Frame {
+    std::unique_ptr<DrmDisplayComposition> composition;
+    UniqueFd fence;
+    uint64_t point;
+  };
+
+  int WaitFrame(const Frame &frame);
+
+  // Each wait is bounded so exit requests are noticed, frames whose fences
+  // haven't signaled after kWaitTries are dropped.
+  static const int kWaitTimeoutMs = 100;
+  static const int kWaitTries = 10;
+
+  DrmDisplayCompositor *compositor_;
+  int display_;
+  DrmSyncobjTimeline *timeline_;
+
+  std::deque<Frame> frames_;
+  // A frame has been taken off frames_ and is being waited on
+  bool waiting_;
+};
+}  // namespace android
+
+#endif  // ANDROID_FENCE_WORKER_H_
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-histogram-worker"
+
+#include "histogramworker.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+#include <hardware/gralloc.h>
+#include <log/log.h>
+#include <sync/sync.h>
+#include <system/graphics.h>
+#include <system/thread_defs.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+static uint32_t BytesPerPixel(uint32_t format) {
+  switch (format) {
+    case HAL_PIXEL_FORMAT_RGB_888:
+      return 3;
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+// Byte offsets of the red, green and blue channels in a pixel
+static const uint32_t *ChannelOffsets(uint32_t format) {
+  static const uint32_t kRgb[] = {0, 1, 2};
+  static const uint32_t kBgr[] = {2, 1, 0};
+  return format == HAL_PIXEL_FORMAT_BGRA_8888 ? kBgr : kRgb;
+}
+
+HistogramWorker::HistogramWorker()
+    : Worker("histogram", ANDROID_PRIORITY_BACKGROUND),
+      display_(-1),
+      interval_ns_(0),
+      last_sample_ns_(0),
+      busy_(false),
+      pending_timestamp_ns_(0),
+      timestamp_ns_(-1),
+      samples_(0),
+      failures_(0) {
+}
+
+HistogramWorker::~HistogramWorker() {
+}
+
+int HistogramWorker::Init(int display) {
+  display_ = display;
+
+  char interval_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.content_sampling_ms", interval_prop, "0");
+  SetInterval(atoi(interval_prop));
+
+  return InitWorker(display);
+}
+
+void HistogramWorker::SetInterval(uint32_t interval_ms) {
+  Lock();
+  interval_ns_ = (int64_t)interval_ms * 1000 * 1000;
+  // Don't hold on to a framebuffer sized buffer while sampling is off
+  if (!interval_ns_)
+    buffer_.clear();
+  Unlock();
+}
+
+bool HistogramWorker::SampleDue() {
+  Lock();
+  bool due = interval_ns_ > 0 && !busy_ &&
+             GetMonotonicNs() - last_sample_ns_ >= interval_ns_;
+  Unlock();
+  return due;
+}
+
+bool HistogramWorker::IsFormatSupported(uint32_t format) {
+  return BytesPerPixel(format) != 0;
+}
+
+sp<GraphicBuffer> HistogramWorker::GetBuffer(uint32_t width, uint32_t height,
+                                             uint32_t format) {
+  Lock();
+  if (buffer_ != NULL && buffer_->getWidth() == width &&
+      buffer_->getHeight() == height &&
+      (uint32_t)buffer_->getPixelFormat() == format) {
+    sp<GraphicBuffer> buffer = buffer_;
+    Unlock();
+    return buffer;
+  }
+  Unlock();
+
+  // Written by the display engine, read by the CPU
+  uint32_t usage = GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_SW_READ_OFTEN;
+  sp<GraphicBuffer> buffer = new GraphicBuffer(width, height, format, usage);
+  if (buffer->initCheck()) {
+    ALOGE("Failed to allocate %ux%u sample buffer for display %d", width,
+          height, display_);
+    return sp<GraphicBuffer>();
+  }
+
+  Lock();
+  buffer_ = buffer;
+  Unlock();
+  return buffer;
+}
+
+void HistogramWorker::QueueSample(std::unique_ptr<DrmHwcLayer> layer,
+                                  const sp<GraphicBuffer> &buffer, int fence,
+                                  int64_t timestamp_ns) {
+  Lock();
+  layer_ = std::move(layer);
+  pending_buffer_ = buffer;
+  fence_.Set(fence);
+  pending_timestamp_ns_ = timestamp_ns;
+  last_sample_ns_ = timestamp_ns;
+  busy_ = true;
+  Unlock();
+  Signal();
+}
+
+bool HistogramWorker::GetSample(int64_t *timestamp_ns,
+                                std::vector<uint32_t> *histograms) {
+  Lock();
+  bool valid = timestamp_ns_ >= 0;
+  if (valid) {
+    *timestamp_ns = timestamp_ns_;
+    *histograms = histograms_;
+  }
+  Unlock();
+  return valid;
+}
+
+void HistogramWorker::Accumulate(const uint8_t *pixels, uint32_t width,
+                                 uint32_t height, uint32_t stride,
+                                 uint32_t format) {
+  memset(lanes_, 0, sizeof(lanes_));
+  uint32_t bytes_per_pixel = BytesPerPixel(format);
+  const uint32_t *offsets = ChannelOffsets(format);
+
+  // Incrementing a single histogram stalls on every run of equal pixels,
+  // which is most of what a display shows, as each increment waits on the
+  // previous one. Spreading consecutive pixels over kNumLanes copies lets
+  // those increments overlap.
+  uint32_t row_bytes = stride * bytes_per_pixel;
+  uint32_t lane_width = width - width % kNumLanes;
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t *p = pixels + (size_t)y * row_bytes;
+    uint32_t x = 0;
+    for (; x < lane_width; x += kNumLanes) {
+      for (uint32_t lane = 0; lane < kNumLanes; ++lane) {
+        for (uint32_t c = 0; c < kNumChannels; ++c)
+          ++lanes_[c][lane][p[offsets[c]]];
+        p += bytes_per_pixel;
+      }
+    }
+    for (; x < width; ++x) {
+      for (uint32_t c = 0; c < kNumChannels; ++c)
+        ++lanes_[c][0][p[offsets[c]]];
+      p += bytes_per_pixel;
+    }
+  }
+}
+
+void HistogramWorker::Routine() {
+  Lock();
+  if (!layer_) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || !layer_) {
+      Unlock();
+      return;
+    }
+  }
+  std::unique_ptr<DrmHwcLayer> layer = std::move(layer_);
+  UniqueFd fence = std::move(fence_);
+  int64_t timestamp_ns = pending_timestamp_ns_;
+  sp<GraphicBuffer> buffer = pending_buffer_;
+  pending_buffer_.clear();
+  Unlock();
+
+  ATRACE_CALL();
+  int ret = 0;
+  void *pixels = NULL;
+  uint32_t format = buffer->getPixelFormat();
+  if (!BytesPerPixel(format))
+    ret = -EINVAL;
+  if (!ret && fence.get() >= 0)
+    ret = sync_wait(fence.get(), kFenceTimeoutMs);
+  if (!ret)
+    ret = buffer->lock(GRALLOC_USAGE_SW_READ_OFTEN, &pixels);
+  if (!ret) {
+    Accumulate((const uint8_t *)pixels, buffer->getWidth(),
+               buffer->getHeight(), buffer->getStride(), format);
+    buffer->unlock();
+  } else {
+    ALOGW("Failed to read content sample of display %d %d", display_, ret);
+  }
+  layer.reset();
+
+  Lock();
+  if (!ret) {
+    // Independent bins, this is the part that vectorizes
+    histograms_.resize(kNumChannels * kNumBins);
+    for (uint32_t c = 0; c < kNumChannels; ++c) {
+      uint32_t *out = &histograms_[c * kNumBins];
+      memcpy(out, lanes_[c][0], sizeof(lanes_[c][0]));
+      for (uint32_t lane = 1; lane < kNumLanes; ++lane)
+        for (uint32_t i = 0; i < kNumBins; ++i)
+          out[i] += lanes_[c][lane][i];
+    }
+    timestamp_ns_ = timestamp_ns;
+    ++samples_;
+  } else {
+    ++failures_;
+  }
+  busy_ = false;
+  Unlock();
+}
+
+void HistogramWorker::Dump(std::ostringstream *out) {
+  Lock();
+  if (interval_ns_ || samples_ || failures_)
+    *out << "    content sampling: interval_ms="
+         << interval_ns_ / (1000 * 1000)
+         << " samples=" << samples_ << " failures=" << failures_ << "\n";
+  Unlock();
+}
+}  // namespace android
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HISTOGRAM_WORKER_H_
+#define ANDROID_HISTOGRAM_WORKER_H_
+
+#include "autofd.h"
+#include "drmhwcomposer.h"
+#include "worker.h"
+
+#include <stdint.h>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <ui/GraphicBuffer.h>
+
+namespace android {
+
+// Computes histograms of the red, green and blue channels of what a display
+// shows, from frames written back by the commits that show them. It runs at
+// background priority, so samples never hold up a frame.
+class HistogramWorker : public Worker {
+ public:
+  static const uint32_t kNumBins = 256;
+  static const uint32_t kNumChannels = 3;
+
+  HistogramWorker();
+  ~HistogramWorker() override;
+
+  int Init(int display);
+
+  // Samples are taken at most once every interval_ms, 0 stops sampling
+  void SetInterval(uint32_t interval_ms);
+  // Whether the next frame should be sampled, there's a single sample in
+  // flight at most.
+  bool SampleDue();
+  // Buffer for writeback to write the next sample into, format is one of the
+  // RGB formats the histograms can be computed from, see IsFormatSupported().
+  sp<GraphicBuffer> GetBuffer(uint32_t width, uint32_t height,
+                              uint32_t format);
+  static bool IsFormatSupported(uint32_t format);
+  // Takes over buffer, from GetBuffer(), and the layer it was imported in.
+  // It holds a frame shown at timestamp_ns once fence signals.
+  void QueueSample(std::unique_ptr<DrmHwcLayer> layer,
+                   const sp<GraphicBuffer> &buffer, int fence,
+                   int64_t timestamp_ns);
+
+  // Copies the latest histograms, kNumBins bins for each channel, into
+  // histograms. Returns false if there's been no sample yet.
+  bool GetSample(int64_t *timestamp_ns, std::vector<uint32_t> *histograms);
+  void Dump(std::ostringstream *out);
+
+ protected:
+  void Routine() override;
+
+ private:
+  // Consecutive pixels count into separate copies of the histograms, so
+  // their increments don't depend on one another.
+  static const uint32_t kNumLanes = 4;
+  static const int kFenceTimeoutMs = 1000;
+
+  void Accumulate(const uint8_t *pixels, uint32_t width, uint32_t height,
+                  uint32_t stride, uint32_t format);
+
+  int display_;
+  int64_t interval_ns_;
+  int64_t last_sample_ns_;
+  bool busy_;
+
+  // Kept for the next sample, the one in flight is in pending_buffer_
+  sp<GraphicBuffer> buffer_;
+  sp<GraphicBuffer> pending_buffer_;
+  std::unique_ptr<DrmHwcLayer> layer_;
+  UniqueFd fence_;
+  int64_t pending_timestamp_ns_;
+
+  // Only touched by the worker thread
+  uint32_t lanes_[kNumChannels][kNumLanes][kNumBins];
+
+  int64_t timestamp_ns_;
+  std::vector<uint32_t> histograms_;
+  uint64_t samples_;
+  uint64_t failures_;
+};
+}  // namespace android
+
+#endif  // ANDROID_HISTOGRAM_WORKER_H_
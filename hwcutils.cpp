@@ -20,13 +20,23 @@
 #include "drmhwcomposer.h"
 #include "platform.h"
 
+#include <time.h>
+
 #include <log/log.h>
 #include <ui/GraphicBufferMapper.h>
+#include <xf86drmMode.h>
 
 #define UNUSED(x) (void)(x)
 
 namespace android {
 
+int64_t GetMonotonicNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
 const hwc_drm_bo *DrmHwcBuffer::operator->() const {
   if (importer_ == NULL) {
     ALOGE("Access of non-existent BO");
@@ -61,6 +71,35 @@ int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
   return 0;
 }
 
+int DrmHwcBuffer::ReinterpretFormat(int drm_fd, uint32_t format) {
+  if (importer_ == NULL)
+    return -EINVAL;
+  if (bo_.format == format)
+    return 0;
+
+  uint32_t fb_id = 0;
+  int ret;
+  if (bo_.modifiers[0])
+    ret = drmModeAddFB2WithModifiers(drm_fd, bo_.width, bo_.height, format,
+                                     bo_.gem_handles, bo_.pitches,
+                                     bo_.offsets, bo_.modifiers, &fb_id,
+                                     DRM_MODE_FB_MODIFIERS);
+  else
+    ret = drmModeAddFB2(drm_fd, bo_.width, bo_.height, format,
+                        bo_.gem_handles, bo_.pitches, bo_.offsets, &fb_id, 0);
+  if (ret) {
+    ALOGE("Failed to add fb in format %c%c%c%c %d", format, format >> 8,
+          format >> 16, format >> 24, ret);
+    return ret;
+  }
+
+  if (bo_.fb_id && drmModeRmFB(drm_fd, bo_.fb_id))
+    ALOGE("Failed to rm fb");
+  bo_.fb_id = fb_id;
+  bo_.format = format;
+  return 0;
+}
+
 int DrmHwcNativeHandle::CopyBufferHandle(buffer_handle_t handle, int width,
                                          int height, int layerCount, int format,
                                          int usage, int stride) {
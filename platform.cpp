@@ -46,6 +46,15 @@ int Planner::PlanStage::ValidatePlane(DrmPlane *plane, DrmHwcLayer *layer) {
     return -EINVAL;
   }
 
+  if (layer->buffer && !plane->IsFormatSupported(layer->buffer->format,
+                                                  layer->buffer->modifiers[0])) {
+    ALOGE("Format %c%c%c%c is not supported on plane %d",
+          layer->buffer->format, layer->buffer->format >> 8,
+          layer->buffer->format >> 16, layer->buffer->format >> 24,
+          plane->id());
+    return -EINVAL;
+  }
+
   if (plane->alpha_property().id() == 0 && layer->alpha != 0xffff) {
     ALOGE("Alpha is not supported on plane %d", plane->id());
     return -EINVAL;
@@ -19,11 +19,13 @@
 
 #include "drmdisplaycomposition.h"
 #include "drmhwcomposer.h"
+#include "sidebandstream.h"
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
 #include <map>
+#include <memory>
 #include <vector>
 
 namespace android {
@@ -52,6 +54,17 @@ class Importer {
 
   // Checks if importer can import the buffer.
   virtual bool CanImportBuffer(buffer_handle_t handle) = 0;
+
+  // Returns the DRM_FORMAT_* buffers of hal_format are imported as
+  virtual uint32_t ConvertHalFormatToDrm(uint32_t hal_format) = 0;
+
+  // Connects to the producer of the sideband stream referred to by handle.
+  // Platforms which don't know how to return NULL, and sideband layers are
+  // then composited by SurfaceFlinger.
+  virtual std::unique_ptr<SidebandStream> OpenSidebandStream(
+      const native_handle_t * /*handle*/) {
+    return NULL;
+  }
 };
 
 class Planner {
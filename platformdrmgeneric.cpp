@@ -19,6 +19,11 @@
 #include "platformdrmgeneric.h"
 #include "drmdevice.h"
 #include "platform.h"
+#include "sidebandsocket.h"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 #include <drm/drm_fourcc.h>
 #include <xf86drm.h>
@@ -77,6 +82,8 @@ uint32_t DrmGenericImporter::ConvertHalFormatToDrm(uint32_t hal_format) {
       return DRM_FORMAT_BGR565;
     case HAL_PIXEL_FORMAT_YV12:
       return DRM_FORMAT_YVU420;
+    case HAL_PIXEL_FORMAT_YCBCR_420_888:
+      return DRM_FORMAT_NV12;
     default:
       ALOGE("Cannot convert hal format to drm format %u", hal_format);
       return -EINVAL;
@@ -95,6 +102,10 @@ uint32_t DrmGenericImporter::DrmFormatToBitsPerPixel(uint32_t drm_format) {
       return 16;
     case DRM_FORMAT_YVU420:
       return 12;
+    // The stride is the one of the luma plane
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_NV21:
+      return 8;
     default:
       ALOGE("Cannot convert hal format %u to bpp (returning 32)", drm_format);
       return 32;
@@ -107,7 +118,12 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
     return -EINVAL;
 
   uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
+  int ret;
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(),
+                                  DrmIoctlWatchdog::kPrimeImport);
+    ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
+  }
   if (ret) {
     ALOGE("failed to import prime fd %d ret=%d", gr_handle->prime_fd, ret);
     return ret;
@@ -125,8 +141,40 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->gem_handles[0] = gem_handle;
   bo->offsets[0] = 0;
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  // Where the chroma planes of flexible YCbCr are is up to gralloc
+  if (gr_handle->format == HAL_PIXEL_FORMAT_YCBCR_420_888) {
+    YCbCrLayout layout;
+    ret = GetYCbCrLayout(handle, bo->width, bo->height, &layout);
+    if (ret) {
+      ReleaseBuffer(bo);
+      return ret;
+    }
+    bo->format = layout.format;
+    bo->pitches[0] = layout.pitches[0];
+    bo->pitches[1] = layout.pitches[1];
+    bo->gem_handles[1] = bo->gem_handles[0];
+    bo->offsets[1] = layout.chroma_offset;
+  }
+
+  // Compressed or tiled buffers need their modifier passed along
+  bool has_modifier = gr_handle->modifier != DRM_FORMAT_MOD_LINEAR &&
+                      gr_handle->modifier != DRM_FORMAT_MOD_INVALID;
+  if (has_modifier)
+    bo->modifiers[0] = gr_handle->modifier;
+
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(), DrmIoctlWatchdog::kAddFb);
+    if (has_modifier)
+      ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
+                                       bo->format, bo->gem_handles,
+                                       bo->pitches, bo->offsets,
+                                       bo->modifiers, &bo->fb_id,
+                                       DRM_MODE_FB_MODIFIERS);
+    else
+      ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
+                          bo->gem_handles, bo->pitches, bo->offsets,
+                          &bo->fb_id, 0);
+  }
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
     return ret;
@@ -135,6 +183,63 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   return ret;
 }
 
+int DrmGenericImporter::GetYCbCrLayout(buffer_handle_t handle,
+                                       uint32_t width, uint32_t height,
+                                       YCbCrLayout *layout) {
+  struct stat st;
+  bool cacheable = !fstat(gralloc_handle(handle)->prime_fd, &st);
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(ycbcr_lock_);
+    auto cached = ycbcr_layouts_.find(st.st_ino);
+    if (cached != ycbcr_layouts_.end()) {
+      *layout = cached->second;
+      return 0;
+    }
+  }
+
+  if (gralloc_->common.module_api_version < GRALLOC_MODULE_API_VERSION_0_2 ||
+      !gralloc_->lock_ycbcr) {
+    ALOGE("Gralloc can't describe YCbCr buffers");
+    return -EINVAL;
+  }
+
+  struct android_ycbcr ycbcr;
+  memset(&ycbcr, 0, sizeof(ycbcr));
+  int ret = gralloc_->lock_ycbcr(gralloc_, handle,
+                                 GRALLOC_USAGE_SW_READ_RARELY, 0, 0, width,
+                                 height, &ycbcr);
+  if (ret) {
+    ALOGE("Failed to get YCbCr layout %d", ret);
+    return ret;
+  }
+  gralloc_->unlock(gralloc_, handle);
+
+  // Only the semi-planar layouts can be scanned out, with the luma plane
+  // first in the buffer as gralloc maps it.
+  uintptr_t y = (uintptr_t)ycbcr.y;
+  uintptr_t cb = (uintptr_t)ycbcr.cb;
+  uintptr_t cr = (uintptr_t)ycbcr.cr;
+  if (ycbcr.chroma_step != 2 || (cr != cb + 1 && cb != cr + 1) || cb < y ||
+      cr < y) {
+    ALOGE("Unsupported YCbCr layout, chroma step %zu", ycbcr.chroma_step);
+    return -EINVAL;
+  }
+
+  layout->format = cr == cb + 1 ? DRM_FORMAT_NV12 : DRM_FORMAT_NV21;
+  layout->pitches[0] = ycbcr.ystride;
+  layout->pitches[1] = ycbcr.cstride;
+  layout->chroma_offset = std::min(cb, cr) - y;
+
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(ycbcr_lock_);
+    // Streams cycle through a handful of buffers, anything older is gone
+    if (ycbcr_layouts_.size() >= kMaxYCbCrLayouts)
+      ycbcr_layouts_.clear();
+    ycbcr_layouts_[st.st_ino] = *layout;
+  }
+  return 0;
+}
+
 int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
   if (bo->fb_id)
     if (drmModeRmFB(drm_->fd(), bo->fb_id))
@@ -167,6 +272,11 @@ bool DrmGenericImporter::CanImportBuffer(buffer_handle_t handle) {
   return true;
 }
 
+std::unique_ptr<SidebandStream> DrmGenericImporter::OpenSidebandStream(
+    const native_handle_t *handle) {
+  return SocketSidebandStream::Open(handle);
+}
+
 #ifdef USE_DRM_GENERIC_IMPORTER
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
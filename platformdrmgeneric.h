@@ -21,6 +21,10 @@
 #include "platform.h"
 
 #include <hardware/gralloc.h>
+#include <sys/types.h>
+
+#include <map>
+#include <mutex>
 
 namespace android {
 
@@ -35,13 +39,35 @@ class DrmGenericImporter : public Importer {
   int ReleaseBuffer(hwc_drm_bo_t *bo) override;
   bool CanImportBuffer(buffer_handle_t handle) override;
 
-  uint32_t ConvertHalFormatToDrm(uint32_t hal_format);
+  uint32_t ConvertHalFormatToDrm(uint32_t hal_format) override;
   uint32_t DrmFormatToBitsPerPixel(uint32_t drm_format);
 
+  // Streams whose producer passes buffers over a socket, see
+  // SocketSidebandStream
+  std::unique_ptr<SidebandStream> OpenSidebandStream(
+      const native_handle_t *handle) override;
+
  private:
+  struct YCbCrLayout {
+    uint32_t format;
+    uint32_t pitches[2];
+    uint32_t chroma_offset;
+  };
+
+  // Finds the format and chroma plane of a HAL_PIXEL_FORMAT_YCBCR_420_888
+  // buffer as gralloc laid it out
+  int GetYCbCrLayout(buffer_handle_t handle, uint32_t width, uint32_t height,
+                     YCbCrLayout *layout);
+
   DrmDevice *drm_;
 
   const gralloc_module_t *gralloc_;
+
+  // Layouts by the inode of the dma-buf, so gralloc is only locked the first
+  // time a buffer is imported rather than every frame.
+  static const size_t kMaxYCbCrLayouts = 64;
+  std::mutex ycbcr_lock_;
+  std::map<ino_t, YCbCrLayout> ycbcr_layouts_;
 };
 }  // namespace android
 
@@ -136,7 +136,12 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
     return -EINVAL;
 
   uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), hnd->share_fd, &gem_handle);
+  int ret;
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(),
+                                  DrmIoctlWatchdog::kPrimeImport);
+    ret = drmPrimeFDToHandle(drm_->fd(), hnd->share_fd, &gem_handle);
+  }
   if (ret) {
     ALOGE("failed to import prime fd %d ret=%d", hnd->share_fd, ret);
     return ret;
@@ -159,6 +164,7 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->pitches[0] = hnd->byte_stride;
   bo->gem_handles[0] = gem_handle;
   bo->offsets[0] = 0;
+  bo->modifiers[0] = modifiers[0];
 
   switch (fmt) {
     case DRM_FORMAT_YVU420: {
@@ -185,10 +191,13 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
       break;
   }
 
-  ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
-                                   bo->format, bo->gem_handles, bo->pitches,
-                                   bo->offsets, modifiers, &bo->fb_id,
-                                   modifiers[0] ? DRM_MODE_FB_MODIFIERS : 0);
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(), DrmIoctlWatchdog::kAddFb);
+    ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
+                                     bo->format, bo->gem_handles, bo->pitches,
+                                     bo->offsets, modifiers, &bo->fb_id,
+                                     modifiers[0] ? DRM_MODE_FB_MODIFIERS : 0);
+  }
 
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
@@ -73,7 +73,12 @@ int DrmMinigbmImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
     return -EINVAL;
 
   uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->fds[0], &gem_handle);
+  int ret;
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(),
+                                  DrmIoctlWatchdog::kPrimeImport);
+    ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->fds[0], &gem_handle);
+  }
   if (ret) {
     ALOGE("failed to import prime fd %d ret=%d", gr_handle->fds[0], ret);
     return ret;
@@ -90,8 +95,12 @@ int DrmMinigbmImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->offsets[0] = gr_handle->offsets[0];
   bo->gem_handles[0] = gem_handle;
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(), DrmIoctlWatchdog::kAddFb);
+    ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
+                        bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id,
+                        0);
+  }
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
     return ret;
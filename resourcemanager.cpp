@@ -46,7 +46,12 @@ int ResourceManager::Init() {
   }
 
   if (!num_displays_) {
-    ALOGE("Failed to initialize any displays");
+    bool headless = false;
+    for (auto &drm : drms_)
+      headless |= drm->headless();
+    ALOGE("Failed to initialize any displays%s",
+          headless ? ", headless without connectors needs hwc.drm.headless.mode"
+                   : "");
     return ret ? -EINVAL : ret;
   }
 
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define LOG_TAG "hwc-sideband-socket"
+
+#include "sidebandsocket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include <hardware/hardware.h>
+#include <log/log.h>
+
+namespace android {
+
+// Owns the native handle of a frame and releases it to the producer once
+// the last reference to it is dropped
+class SocketSidebandStream::Frame : public SidebandFrame {
+ public:
+  Frame(std::shared_ptr<UniqueFd> socket, uint32_t id, native_handle_t *handle)
+      : socket_(std::move(socket)), id_(id), handle_(handle) {
+  }
+
+  ~Frame() override {
+    native_handle_close(handle_);
+    native_handle_delete(handle_);
+    // The producer may have hung up already, there's no one to tell then
+    Release release = {.id = id_};
+    if (TEMP_FAILURE_RETRY(send(socket_->get(), &release, sizeof(release),
+                                MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 &&
+        errno != EPIPE)
+      ALOGW("Failed to release sideband frame %u %d", id_, errno);
+  }
+
+  buffer_handle_t buffer() const override {
+    return handle_;
+  }
+
+ private:
+  std::shared_ptr<UniqueFd> socket_;
+  uint32_t id_;
+  native_handle_t *handle_;
+};
+
+// static
+std::unique_ptr<SidebandStream> SocketSidebandStream::Open(
+    const native_handle_t *handle) {
+  if (!handle || handle->numFds != 1)
+    return NULL;
+
+  int type = 0;
+  socklen_t len = sizeof(type);
+  if (getsockopt(handle->data[0], SOL_SOCKET, SO_TYPE, &type, &len) ||
+      type != SOCK_SEQPACKET)
+    return NULL;
+
+  int fd = fcntl(handle->data[0], F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    ALOGE("Failed to dup sideband socket %d", errno);
+    return NULL;
+  }
+  return std::unique_ptr<SidebandStream>(new SocketSidebandStream(fd));
+}
+
+SocketSidebandStream::SocketSidebandStream(int fd)
+    : Worker("sideband_socket", HAL_PRIORITY_URGENT_DISPLAY),
+      socket_(std::make_shared<UniqueFd>(fd)),
+      listener_(NULL) {
+}
+
+SocketSidebandStream::~SocketSidebandStream() {
+  Stop();
+}
+
+int SocketSidebandStream::Start(Listener *listener) {
+  listener_ = listener;
+  return InitWorker();
+}
+
+void SocketSidebandStream::Stop() {
+  Exit();
+}
+
+int SocketSidebandStream::ReceiveFrame() {
+  struct pollfd pfd = {.fd = socket_->get(), .events = POLLIN, .revents = 0};
+  int ret = poll(&pfd, 1, kPollTimeoutMs);
+  if (ret <= 0)
+    return ret < 0 && errno != EINTR ? -EPIPE : 0;
+
+  struct {
+    Header header;
+    int ints[kMaxInts];
+  } msg;
+  struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+  char control[CMSG_SPACE(sizeof(int) * (kMaxFds + 1))];
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+
+  ssize_t len = TEMP_FAILURE_RETRY(
+      recvmsg(socket_->get(), &hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT));
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (len <= 0)
+    return -EPIPE;
+
+  // The fds are owned from here on, whatever is wrong with the message
+  std::vector<UniqueFd> fds;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int *data = (int *)CMSG_DATA(cmsg);
+    size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < num_fds; ++i)
+      fds.emplace_back(data[i]);
+  }
+
+  const Header &header = msg.header;
+  if ((hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      (size_t)len < sizeof(header) || header.num_fds > kMaxFds ||
+      header.num_ints > kMaxInts ||
+      (size_t)len != sizeof(header) + header.num_ints * sizeof(int) ||
+      fds.size() != header.num_fds + (header.has_fence ? 1 : 0)) {
+    ALOGE("Dropping malformed sideband frame of %zd bytes and %zu fds", len,
+          fds.size());
+    return -EINVAL;
+  }
+
+  native_handle_t *handle = native_handle_create(header.num_fds,
+                                                 header.num_ints);
+  if (!handle) {
+    ALOGE("Failed to create sideband frame handle");
+    return -ENOMEM;
+  }
+  for (uint32_t i = 0; i < header.num_fds; ++i)
+    handle->data[i] = fds[i].Release();
+  memcpy(handle->data + header.num_fds, msg.ints,
+         header.num_ints * sizeof(int));
+  int acquire_fence = header.has_fence ? fds[header.num_fds].Release() : -1;
+
+  listener_->OnSidebandFrame(std::make_shared<Frame>(socket_, header.id,
+                                                     handle),
+                             acquire_fence);
+  return 0;
+}
+
+void SocketSidebandStream::Routine() {
+  if (ReceiveFrame() != -EPIPE)
+    return;
+
+  // Nothing more is coming once the producer hung up, the frames received
+  // stay valid for as long as they're shown
+  ALOGI("Sideband stream producer hung up");
+  Lock();
+  WaitForSignalOrExitLocked();
+  Unlock();
+}
+}  // namespace android
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ANDROID_SIDEBAND_SOCKET_H_
+#define ANDROID_SIDEBAND_SOCKET_H_
+
+#include "autofd.h"
+#include "sidebandstream.h"
+#include "worker.h"
+
+#include <stdint.h>
+#include <memory>
+
+#include <cutils/native_handle.h>
+
+namespace android {
+
+// A sideband stream whose producer passes the native handles of its buffers
+// over a socket, so that any process allocating buffers the importer can
+// import is able to feed a sideband layer.
+//
+// The sideband handle holds a connected SOCK_SEQPACKET socket as its only fd.
+// Each frame is a single message made of a Header followed by the num_ints
+// ints of the buffer's native handle. The num_fds fds of the handle, then the
+// acquire fence if has_fence is set, are attached as SCM_RIGHTS. Once a frame
+// is off screen, or was skipped, a Release message carrying its id is sent
+// back, and only then may the producer write to its buffer again.
+class SocketSidebandStream : public SidebandStream, public Worker {
+ public:
+  struct Header {
+    uint32_t id;
+    uint32_t num_fds;
+    uint32_t num_ints;
+    uint32_t has_fence;
+  };
+  struct Release {
+    uint32_t id;
+  };
+
+  // Returns NULL if handle doesn't hold such a socket
+  static std::unique_ptr<SidebandStream> Open(const native_handle_t *handle);
+
+  ~SocketSidebandStream() override;
+
+  int Start(Listener *listener) override;
+  void Stop() override;
+
+ protected:
+  void Routine() override;
+
+ private:
+  SocketSidebandStream(int fd);
+
+  class Frame;
+
+  // Returns -EPIPE once the producer hung up
+  int ReceiveFrame();
+
+  static const int kMaxFds = 4;
+  static const int kMaxInts = 64;
+  // Receiving is bounded so that Stop() is noticed
+  static const int kPollTimeoutMs = 100;
+
+  // Shared with the frames, which may outlive the stream
+  std::shared_ptr<UniqueFd> socket_;
+  Listener *listener_;
+};
+}  // namespace android
+
+#endif  // ANDROID_SIDEBAND_SOCKET_H_
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SIDEBAND_STREAM_H_
+#define ANDROID_SIDEBAND_STREAM_H_
+
+#include <memory>
+
+#include <hardware/hardware.h>
+
+namespace android {
+
+// A frame of a sideband stream. It's handed back to the producer, which may
+// then write to its buffer again, once the last reference to it is dropped.
+// Whoever shows the frame holds on to it until it's off screen.
+class SidebandFrame {
+ public:
+  virtual ~SidebandFrame() {
+  }
+
+  virtual buffer_handle_t buffer() const = 0;
+};
+
+// A stream of buffers produced outside of SurfaceFlinger, such as tunneled
+// video, that's flipped onto a plane as soon as each frame is ready.
+class SidebandStream {
+ public:
+  class Listener {
+   public:
+    virtual ~Listener() {
+    }
+
+    // Called from the producer's thread for every new frame. The listener
+    // takes ownership of acquire_fence. Frames it skips are released as soon
+    // as it drops them.
+    virtual void OnSidebandFrame(std::shared_ptr<const SidebandFrame> frame,
+                                 int acquire_fence) = 0;
+  };
+
+  virtual ~SidebandStream() {
+  }
+
+  // Starts delivering frames to listener until Stop() returns
+  virtual int Start(Listener *listener) = 0;
+  virtual void Stop() = 0;
+};
+}  // namespace android
+
+#endif  // ANDROID_SIDEBAND_STREAM_H_
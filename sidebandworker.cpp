@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-sideband-worker"
+
+#include "sidebandworker.h"
+#include "drmdisplaycompositor.h"
+
+#include <errno.h>
+
+#include <log/log.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+SidebandWorker::SidebandWorker()
+    : Worker("sideband", HAL_PRIORITY_URGENT_DISPLAY),
+      compositor_(NULL),
+      display_(-1),
+      flip_pending_(false) {
+}
+
+SidebandWorker::~SidebandWorker() {
+}
+
+int SidebandWorker::Init(DrmDisplayCompositor *compositor, int display) {
+  compositor_ = compositor;
+  display_ = display;
+
+  return InitWorker(display);
+}
+
+void SidebandWorker::Queue(std::shared_ptr<const SidebandFrame> frame,
+                           int acquire_fence) {
+  // A frame that's replaced before it's flipped is released once dropped,
+  // outside of the lock
+  std::shared_ptr<const SidebandFrame> skipped;
+  Lock();
+  skipped = std::move(frame_);
+  frame_ = std::move(frame);
+  acquire_fence_.Set(acquire_fence);
+  Unlock();
+  Signal();
+}
+
+void SidebandWorker::Clear() {
+  std::shared_ptr<const SidebandFrame> skipped;
+  Lock();
+  skipped = std::move(frame_);
+  acquire_fence_.Close();
+  Unlock();
+
+  std::lock_guard<std::mutex> lk(flip_lock_);
+}
+
+void SidebandWorker::FlipDone() {
+  Lock();
+  flip_pending_ = false;
+  Unlock();
+  Signal();
+}
+
+void SidebandWorker::Routine() {
+  Lock();
+  while (!frame_ || flip_pending_) {
+    int ret = WaitForSignalOrExitLocked(
+        flip_pending_ ? kFlipTimeoutMs * 1000 * 1000 : -1);
+    if (ret == -EINTR) {
+      Unlock();
+      return;
+    }
+    if (ret == -ETIMEDOUT && flip_pending_) {
+      ALOGW("No page flip event for sideband frame on display %d", display_);
+      flip_pending_ = false;
+    }
+  }
+  std::shared_ptr<const SidebandFrame> frame = std::move(frame_);
+  UniqueFd acquire_fence(acquire_fence_.Release());
+  // Set ahead of the flip, its event may arrive before the commit returns
+  flip_pending_ = true;
+  std::unique_lock<std::mutex> lk(flip_lock_);
+  Unlock();
+
+  int ret = compositor_->FlipSideband(frame, acquire_fence.get());
+  lk.unlock();
+  if (!ret)
+    return;
+
+  if (ret != -EAGAIN)
+    ALOGE("Failed to flip sideband frame on display %d %d", display_, ret);
+  Lock();
+  flip_pending_ = false;
+  Unlock();
+}
+}  // namespace android
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ANDROID_SIDEBAND_WORKER_H_
+#define ANDROID_SIDEBAND_WORKER_H_
+
+#include "autofd.h"
+#include "sidebandstream.h"
+#include "worker.h"
+
+#include <memory>
+#include <mutex>
+
+namespace android {
+
+class DrmDisplayCompositor;
+
+// Flips the frames of a sideband stream on behalf of the compositor, so the
+// producer's thread never waits on a fence or a commit. Flips don't block,
+// the next one is made once the page flip event of the last one arrived and
+// only the latest of the frames that came in meanwhile is shown. The others
+// are released back to the producer as they're replaced.
+class SidebandWorker : public Worker {
+ public:
+  SidebandWorker();
+  ~SidebandWorker() override;
+
+  int Init(DrmDisplayCompositor *compositor, int display);
+
+  // Takes ownership of acquire_fence
+  void Queue(std::shared_ptr<const SidebandFrame> frame, int acquire_fence);
+  // Drops the frame that has yet to be flipped and waits for the one being
+  // flipped, no frame of the stream is flipped afterwards.
+  void Clear();
+  // Called from the page flip event of the last flip
+  void FlipDone();
+
+ protected:
+  void Routine() override;
+
+ private:
+  // A flip whose event hasn't arrived by then is assumed to be done
+  static const int kFlipTimeoutMs = 100;
+
+  DrmDisplayCompositor *compositor_;
+  int display_;
+
+  std::shared_ptr<const SidebandFrame> frame_;
+  UniqueFd acquire_fence_;
+  bool flip_pending_;
+  // Held while a frame is imported and flipped
+  std::mutex flip_lock_;
+};
+}  // namespace android
+
+#endif  // ANDROID_SIDEBAND_WORKER_H_
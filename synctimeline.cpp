@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-sync-timeline"
+
+#include "synctimeline.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/types.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include <log/log.h>
+
+// From drivers/dma-buf/sw_sync.c, the interface isn't part of the uapi
+// headers.
+struct sw_sync_create_fence_data {
+  __u32 value;
+  char name[32];
+  __s32 fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE \
+  _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+
+namespace android {
+
+static const char *const kSwSyncPaths[] = {
+    "/sys/kernel/debug/sync/sw_sync",
+    "/dev/sw_sync",
+};
+
+SyncTimeline::SyncTimeline() : last_point_(0), signaled_point_(0) {
+}
+
+int SyncTimeline::Init() {
+  for (const char *path : kSwSyncPaths) {
+    fd_.Set(open(path, O_RDWR | O_CLOEXEC));
+    if (fd_.get() >= 0)
+      return 0;
+  }
+  ALOGE("Failed to open sw_sync %d", errno);
+  return -errno;
+}
+
+int SyncTimeline::CreateFence(uint32_t *point) {
+  std::lock_guard<std::mutex> lk(lock_);
+  struct sw_sync_create_fence_data data;
+  memset(&data, 0, sizeof(data));
+  data.value = last_point_ + 1;
+  strncpy(data.name, "hwc_retire", sizeof(data.name) - 1);
+  if (ioctl(fd_.get(), SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+    ALOGE("Failed to create timeline fence %d", errno);
+    return -errno;
+  }
+
+  *point = ++last_point_;
+  return data.fence;
+}
+
+void SyncTimeline::Signal(uint32_t point) {
+  std::lock_guard<std::mutex> lk(lock_);
+  SignalLocked(point);
+}
+
+void SyncTimeline::SignalAll() {
+  std::lock_guard<std::mutex> lk(lock_);
+  SignalLocked(last_point_);
+}
+
+void SyncTimeline::SignalLocked(uint32_t point) {
+  // Points are signaled in order, a late event for an older point is a no-op
+  if ((int32_t)(point - signaled_point_) <= 0)
+    return;
+
+  __u32 count = point - signaled_point_;
+  if (ioctl(fd_.get(), SW_SYNC_IOC_INC, &count) < 0) {
+    ALOGE("Failed to advance timeline to %u %d", point, errno);
+    return;
+  }
+  signaled_point_ = point;
+}
+}  // namespace android
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SYNC_TIMELINE_H_
+#define ANDROID_SYNC_TIMELINE_H_
+
+#include "autofd.h"
+
+#include <stdint.h>
+#include <mutex>
+
+namespace android {
+
+// A sw_sync timeline whose fences are signaled by the compositor itself,
+// standing in for OUT_FENCE_PTR on CRTCs which don't have it.
+class SyncTimeline {
+ public:
+  SyncTimeline();
+  SyncTimeline(const SyncTimeline &) = delete;
+
+  int Init();
+  bool initialized() const {
+    return fd_.get() >= 0;
+  }
+
+  // Returns a fence for the next point on the timeline, which is stored in
+  // point, or a negative errno.
+  int CreateFence(uint32_t *point);
+  // Advances the timeline to point, signaling the fences up to it
+  void Signal(uint32_t point);
+  // Signals every fence created so far
+  void SignalAll();
+
+ private:
+  void SignalLocked(uint32_t point);
+
+  std::mutex lock_;
+  UniqueFd fd_;
+  uint32_t last_point_;
+  uint32_t signaled_point_;
+};
+}  // namespace android
+
+#endif  // ANDROID_SYNC_TIMELINE_H_
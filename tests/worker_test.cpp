@@ -1,7 +1,15 @@
 #include <gtest/gtest.h>
 #include <hardware/hardware.h>
 
+#include <inttypes.h>
+#include <sched.h>
+
 #include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cutils/properties.h>
 
 #include "worker.h"
 
@@ -108,3 +116,141 @@ TEST_F(WorkerTest, exit_while_running) {
   std::this_thread::sleep_for(std::chrono::milliseconds(50));
   worker.Exit();
 }
+
+struct SchedWorker : public Worker {
+  SchedWorker() : Worker("test-sched", HAL_PRIORITY_URGENT_DISPLAY) {
+    CPU_ZERO(&cpus);
+  }
+
+  int Init(int display) {
+    return InitWorker(display);
+  }
+
+  void Routine() {
+    Lock();
+    if (!sampled) {
+      policy = sched_getscheduler(0) & ~SCHED_RESET_ON_FORK;
+      sched_getparam(0, &param);
+      sched_getaffinity(0, sizeof(cpus), &cpus);
+      sampled = true;
+    }
+    WaitForSignalOrExitLocked();
+    Unlock();
+  }
+
+  bool pi_mutex() const {
+    return mutex_.priority_inheritance();
+  }
+
+  // Waits for the worker thread to record its scheduling
+  bool WaitSampled() {
+    for (int i = 0; i < 1000; ++i) {
+      Lock();
+      bool done = sampled;
+      Unlock();
+      if (done)
+        return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+
+  bool sampled = false;
+  int policy = -1;
+  struct sched_param param = {};
+  cpu_set_t cpus;
+};
+
+struct WorkerSchedTest : public testing::Test {
+  static const int kDisplay = 3;
+  static const int kOtherDisplay = 4;
+
+  virtual void TearDown() {
+    for (const std::string &name : set_properties_)
+      property_set(name.c_str(), "");
+  }
+
+  // Sets a property of the worker for kDisplay
+  bool SetProperty(const char *key, const char *value) {
+    std::string name = "hwc.drm.worker.test-sched." +
+                       std::to_string(kDisplay) + "." + key;
+    if (property_set(name.c_str(), value))
+      return false;
+    set_properties_.push_back(name);
+    return true;
+  }
+
+ private:
+  std::vector<std::string> set_properties_;
+};
+
+TEST_F(WorkerSchedTest, rt_priority) {
+  // Real-time scheduling needs CAP_SYS_NICE
+  bool can_fifo = false;
+  std::thread probe([&can_fifo]() {
+    struct sched_param param = {.sched_priority = 1};
+    can_fifo = !sched_setscheduler(0, SCHED_FIFO, &param);
+  });
+  probe.join();
+  if (!can_fifo || !SetProperty("rt_priority", "2"))
+    GTEST_SKIP();
+
+  SchedWorker worker;
+  ASSERT_EQ(0, worker.Init(kDisplay));
+  SchedWorker other;
+  ASSERT_EQ(0, other.Init(kOtherDisplay));
+  ASSERT_TRUE(worker.WaitSampled());
+  ASSERT_TRUE(other.WaitSampled());
+  worker.Exit();
+  other.Exit();
+
+  EXPECT_EQ(SCHED_FIFO, worker.policy);
+  EXPECT_EQ(2, worker.param.sched_priority);
+  EXPECT_EQ(SCHED_OTHER, other.policy);
+}
+
+TEST_F(WorkerSchedTest, cpu_affinity) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+  int cpu = 0;
+  while (cpu < 64 && !CPU_ISSET(cpu, &allowed))
+    ++cpu;
+  ASSERT_LT(cpu, 64);
+
+  char mask[32];
+  snprintf(mask, sizeof(mask), "%" PRIx64, (uint64_t)1 << cpu);
+  if (!SetProperty("cpu_affinity", mask))
+    GTEST_SKIP();
+
+  SchedWorker worker;
+  ASSERT_EQ(0, worker.Init(kDisplay));
+  SchedWorker other;
+  ASSERT_EQ(0, other.Init(kOtherDisplay));
+  ASSERT_TRUE(worker.WaitSampled());
+  ASSERT_TRUE(other.WaitSampled());
+  worker.Exit();
+  other.Exit();
+
+  EXPECT_EQ(1, CPU_COUNT(&worker.cpus));
+  EXPECT_TRUE(CPU_ISSET(cpu, &worker.cpus));
+  EXPECT_EQ(CPU_COUNT(&allowed), CPU_COUNT(&other.cpus));
+}
+
+TEST_F(WorkerSchedTest, pi_mutex) {
+  if (!SetProperty("pi_mutex", "1"))
+    GTEST_SKIP();
+
+  SchedWorker worker;
+  ASSERT_EQ(0, worker.Init(kDisplay));
+  SchedWorker other;
+  ASSERT_EQ(0, other.Init(kOtherDisplay));
+
+  EXPECT_TRUE(worker.pi_mutex());
+  EXPECT_FALSE(other.pi_mutex());
+
+  // The recreated lock still pairs with the worker's condition variable
+  ASSERT_TRUE(worker.WaitSampled());
+  worker.Exit();
+  other.Exit();
+}
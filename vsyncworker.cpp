@@ -20,8 +20,11 @@
 #include "drmdevice.h"
 #include "worker.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <map>
@@ -36,7 +39,13 @@ VSyncWorker::VSyncWorker()
       drm_(NULL),
       display_(-1),
       enabled_(false),
-      last_timestamp_(-1) {
+      last_timestamp_(-1),
+      use_crtc_sequence_(true),
+      sequence_pending_(false),
+      queued_sequence_(0),
+      sequence_timestamp_(-1),
+      timer_period_ns_(0),
+      timer_next_ns_(0) {
 }
 
 VSyncWorker::~VSyncWorker() {
@@ -46,7 +55,7 @@ int VSyncWorker::Init(DrmDevice *drm, int display) {
   drm_ = drm;
   display_ = display;
 
-  return InitWorker();
+  return InitWorker(display);
 }
 
 void VSyncWorker::RegisterCallback(std::shared_ptr<VsyncCallback> callback) {
@@ -87,10 +96,17 @@ int64_t VSyncWorker::GetPhasedVSync(int64_t frame_ns, int64_t current) {
 
 static const int64_t kOneSecondNs = 1 * 1000 * 1000 * 1000;
 
-int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
-  struct timespec vsync;
-  int ret = clock_gettime(CLOCK_MONOTONIC, &vsync);
+// How long to wait for a queued vblank event before falling back to the
+// synthetic vsync, long enough for the slowest mode.
+static const int64_t kSequenceTimeoutNs = 100 * 1000 * 1000;
+
+static struct timespec NsToTimespec(int64_t ns) {
+  struct timespec ts = {.tv_sec = (time_t)(ns / kOneSecondNs),
+                        .tv_nsec = (long)(ns % kOneSecondNs)};
+  return ts;
+}
 
+int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
   float refresh = 60.0f;  // Default to 60Hz refresh rate
   DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
   if (conn && conn->active_mode().v_refresh() != 0.0f)
@@ -99,18 +115,141 @@ int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
     ALOGW("Vsync worker active with conn=%p refresh=%f\n", conn,
           conn ? conn->active_mode().v_refresh() : 0.0f);
 
-  int64_t phased_timestamp = GetPhasedVSync(kOneSecondNs / refresh,
-                                            vsync.tv_sec * kOneSecondNs +
-                                                vsync.tv_nsec);
-  vsync.tv_sec = phased_timestamp / kOneSecondNs;
-  vsync.tv_nsec = phased_timestamp - (vsync.tv_sec * kOneSecondNs);
+  int64_t frame_ns = kOneSecondNs / refresh;
+
+  if (timer_fd_.get() < 0) {
+    timer_fd_.Set(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC));
+    if (timer_fd_.get() < 0) {
+      ALOGE("Failed to create vsync timer %d", errno);
+      return -errno;
+    }
+  }
+
+  // Rearm when the last vsync didn't come from the timer, or the refresh
+  // rate changed since.
+  if (frame_ns != timer_period_ns_ || last_timestamp_ < 0 ||
+      last_timestamp_ + frame_ns != timer_next_ns_) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
+      return -errno;
+    timer_next_ns_ = GetPhasedVSync(frame_ns,
+                                    now.tv_sec * kOneSecondNs + now.tv_nsec);
+    struct itimerspec spec = {.it_interval = NsToTimespec(frame_ns),
+                              .it_value = NsToTimespec(timer_next_ns_)};
+    if (timerfd_settime(timer_fd_.get(), TFD_TIMER_ABSTIME, &spec, NULL)) {
+      ALOGE("Failed to arm vsync timer %d", errno);
+      return -errno;
+    }
+    timer_period_ns_ = frame_ns;
+  }
+
+  uint64_t expirations = 0;
+  ssize_t len;
   do {
-    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &vsync, NULL);
-  } while (ret == -1 && errno == EINTR);
+    len = read(timer_fd_.get(), &expirations, sizeof(expirations));
+  } while (len < 0 && errno == EINTR);
+  if (len != sizeof(expirations) || !expirations)
+    return len < 0 ? -errno : -EIO;
+
+  // Periods that were missed aren't reported late, only the latest one
+  *timestamp = timer_next_ns_ + (int64_t)(expirations - 1) * frame_ns;
+  timer_next_ns_ = *timestamp + frame_ns;
+  return 0;
+}
+
+void VSyncWorker::StopSyntheticTimer() {
+  if (!timer_period_ns_)
+    return;
+  struct itimerspec spec = {};
+  timerfd_settime(timer_fd_.get(), 0, &spec, NULL);
+  timer_period_ns_ = 0;
+}
+
+/*
+ * Queues an event for the next vblank and waits for the event listener to
+ * deliver it, which gives a nanosecond timestamp and doesn't keep an ioctl
+ * blocked for the whole frame. Returns -EOPNOTSUPP if the kernel doesn't
+ * support it, and -EINTR if vsync got disabled or the worker is exiting.
+ */
+int VSyncWorker::SequenceWaitVBlank(DrmCrtc *crtc, int64_t *timestamp) {
+  if (!use_crtc_sequence_)
+    return -EOPNOTSUPP;
+
+  // The lock is held across the ioctl so that the event can't be delivered
+  // before the sequence it's for has been recorded.
+  DrmSequenceEventHandler *handler = this;
+  Lock();
+  uint64_t queued = 0;
+  int ret = drmCrtcQueueSequence(drm_->fd(), crtc->id(),
+                                 DRM_CRTC_SEQUENCE_RELATIVE, 1, &queued,
+                                 (uint64_t)handler);
+  if (ret) {
+    ret = -errno;
+    Unlock();
+    if (ret == -ENOTTY || ret == -EOPNOTSUPP) {
+      ALOGI("CRTC sequence ioctls unsupported, using drmWaitVBlank");
+      use_crtc_sequence_ = false;
+      return -EOPNOTSUPP;
+    }
+    return ret;
+  }
+
+  sequence_pending_ = true;
+  queued_sequence_ = queued;
+  while (sequence_pending_) {
+    ret = WaitForSignalOrExitLocked(kSequenceTimeoutNs);
+    if (ret)
+      break;
+    if (!enabled_) {
+      ret = -EINTR;
+      break;
+    }
+  }
+  sequence_pending_ = false;
+  if (!ret)
+    *timestamp = sequence_timestamp_;
+  Unlock();
+
+  if (ret == -ETIMEDOUT)
+    ALOGW("Timed out waiting for vblank sequence %" PRIu64 " on crtc %d",
+          queued, crtc->id());
+  return ret;
+}
+
+void VSyncWorker::HandleSequence(uint64_t sequence, uint64_t timestamp_ns) {
+  Lock();
+  // Events for sequences that were given up on are dropped
+  bool expected = sequence_pending_ && sequence == queued_sequence_;
+  if (expected) {
+    sequence_pending_ = false;
+    sequence_timestamp_ = (int64_t)timestamp_ns;
+  }
+  Unlock();
+
+  if (expected)
+    Signal();
+}
+
+int VSyncWorker::LegacyWaitVBlank(DrmCrtc *crtc, int64_t *timestamp) {
+  uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
+
+  drmVBlank vblank;
+  memset(&vblank, 0, sizeof(vblank));
+  vblank.request.type = (drmVBlankSeqType)(
+      DRM_VBLANK_RELATIVE | (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
+  vblank.request.sequence = 1;
+
+  int ret;
+  {
+    DrmIoctlWatchdog::Scope scope(drm_->watchdog(),
+                                  DrmIoctlWatchdog::kWaitVBlank);
+    ret = drmWaitVBlank(drm_->fd(), &vblank);
+  }
   if (ret)
     return ret;
 
-  *timestamp = (int64_t)vsync.tv_sec * kOneSecondNs + (int64_t)vsync.tv_nsec;
+  *timestamp = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
+               (int64_t)vblank.reply.tval_usec * 1000;
   return 0;
 }
 
@@ -119,6 +258,8 @@ void VSyncWorker::Routine() {
 
   Lock();
   if (!enabled_) {
+    // The timer would keep waking up the CPU for nothing
+    StopSyntheticTimer();
     ret = WaitForSignalOrExitLocked();
     if (ret == -EINTR) {
       Unlock();
@@ -134,30 +275,28 @@ void VSyncWorker::Routine() {
   if (!enabled)
     return;
 
-  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display);
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display");
-    return;
-  }
-  uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
-
-  drmVBlank vblank;
-  memset(&vblank, 0, sizeof(vblank));
-  vblank.request.type = (drmVBlankSeqType)(
-      DRM_VBLANK_RELATIVE | (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
-  vblank.request.sequence = 1;
-
   int64_t timestamp;
-  ret = drmWaitVBlank(drm_->fd(), &vblank);
-  if (ret == -EINTR) {
-    return;
-  } else if (ret) {
+  // Virtual CRTCs may never be enabled, don't even try their vblanks. An
+  // unplugged display has no CRTC at all until hotplug binds one again.
+  DrmCrtc *crtc = drm_->headless() ? NULL : drm_->GetCrtcForDisplay(display);
+  if (!crtc) {
     ret = SyntheticWaitVBlank(&timestamp);
     if (ret)
       return;
   } else {
-    timestamp = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
-                (int64_t)vblank.reply.tval_usec * 1000;
+    {
+      DrmIoctlWatchdog::FrameContext watchdog_context(display, 0);
+      ret = SequenceWaitVBlank(crtc, &timestamp);
+      if (ret == -EOPNOTSUPP)
+        ret = LegacyWaitVBlank(crtc, &timestamp);
+    }
+    if (ret == -EINTR) {
+      return;
+    } else if (ret) {
+      ret = SyntheticWaitVBlank(&timestamp);
+      if (ret)
+        return;
+    }
   }
 
   /*
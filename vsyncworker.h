@@ -17,6 +17,7 @@
 #ifndef ANDROID_EVENT_WORKER_H_
 #define ANDROID_EVENT_WORKER_H_
 
+#include "autofd.h"
 #include "drmdevice.h"
 #include "worker.h"
 
@@ -35,7 +36,7 @@ class VsyncCallback {
   virtual void Callback(int display, int64_t timestamp) = 0;
 };
 
-class VSyncWorker : public Worker {
+class VSyncWorker : public Worker, private DrmSequenceEventHandler {
  public:
   VSyncWorker();
   ~VSyncWorker() override;
@@ -50,7 +51,12 @@ class VSyncWorker : public Worker {
 
  private:
   int64_t GetPhasedVSync(int64_t frame_ns, int64_t current);
+  int SequenceWaitVBlank(DrmCrtc *crtc, int64_t *timestamp);
+  int LegacyWaitVBlank(DrmCrtc *crtc, int64_t *timestamp);
   int SyntheticWaitVBlank(int64_t *timestamp);
+  void StopSyntheticTimer();
+
+  void HandleSequence(uint64_t sequence, uint64_t timestamp_ns) override;
 
   DrmDevice *drm_;
 
@@ -62,6 +68,22 @@ class VSyncWorker : public Worker {
   int display_;
   bool enabled_;
   int64_t last_timestamp_;
+
+  // Cleared for good once the kernel turns out not to support the CRTC
+  // sequence ioctls, drmWaitVBlank is used from then on.
+  bool use_crtc_sequence_;
+  // The sequence queued for the vblank being waited for, and its timestamp
+  // once the event for it has been delivered by the event listener.
+  bool sequence_pending_;
+  uint64_t queued_sequence_;
+  int64_t sequence_timestamp_;
+
+  // Periodic timer for the synthetic vsync, it's armed in phase with the
+  // last vsync and keeps that phase by itself. timer_next_ns_ is when it
+  // next expires, timer_period_ns_ is 0 while it's disarmed.
+  UniqueFd timer_fd_;
+  int64_t timer_period_ns_;
+  int64_t timer_next_ns_;
 };
 }  // namespace android
 
@@ -14,23 +14,106 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "hwc-worker"
+
 #include "worker.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
 
+#include <cutils/properties.h>
+#include <log/log.h>
+
 namespace android {
 
+static std::string GetWorkerProperty(const std::string &worker, int display,
+                                     const char *key,
+                                     const char *default_value) {
+  std::string prefix = "hwc.drm.worker." + worker + ".";
+  char value[PROPERTY_VALUE_MAX];
+  if (display >= 0) {
+    std::string name = prefix + std::to_string(display) + "." + key;
+    if (property_get(name.c_str(), value, "") > 0)
+      return value;
+  }
+  property_get((prefix + key).c_str(), value, default_value);
+  return value;
+}
+
+WorkerMutex::WorkerMutex(bool priority_inheritance) {
+  InitMutex(priority_inheritance);
+}
+
+void WorkerMutex::InitMutex(bool priority_inheritance) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  priority_inheritance_ = priority_inheritance;
+  if (priority_inheritance &&
+      pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT)) {
+    ALOGW("Priority inheritance mutexes aren't supported");
+    priority_inheritance_ = false;
+  }
+  pthread_mutex_init(&mutex_, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void WorkerMutex::SetPriorityInheritance(bool priority_inheritance) {
+  if (priority_inheritance == priority_inheritance_)
+    return;
+  pthread_mutex_destroy(&mutex_);
+  InitMutex(priority_inheritance);
+}
+
+WorkerMutex::~WorkerMutex() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void WorkerMutex::lock() {
+  pthread_mutex_lock(&mutex_);
+}
+
+bool WorkerMutex::try_lock() {
+  return pthread_mutex_trylock(&mutex_) == 0;
+}
+
+void WorkerMutex::unlock() {
+  pthread_mutex_unlock(&mutex_);
+}
+
 Worker::Worker(const char *name, int priority)
-    : name_(name), priority_(priority), exit_(false), initialized_(false) {
+    : mutex_(false),
+      name_(name),
+      priority_(priority),
+      rt_priority_(0),
+      cpu_affinity_(0),
+      exit_(false),
+      initialized_(false) {
 }
 
 Worker::~Worker() {
   Exit();
 }
 
-int Worker::InitWorker() {
-  std::lock_guard<std::mutex> lk(mutex_);
+void Worker::ReadScheduling(int display) {
+  rt_priority_ = atoi(
+      GetWorkerProperty(name_, display, "rt_priority", "0").c_str());
+  cpu_affinity_ = strtoull(
+      GetWorkerProperty(name_, display, "cpu_affinity", "0").c_str(), NULL,
+      16);
+  mutex_.SetPriorityInheritance(
+      GetWorkerProperty(name_, display, "pi_mutex", "0") == "1");
+}
+
+int Worker::InitWorker(int display) {
+  if (initialized())
+    return -EALREADY;
+  // Nothing waits on the lock before the thread is started
+  ReadScheduling(display);
+
+  std::lock_guard<WorkerMutex> lk(mutex_);
   if (initialized())
     return -EALREADY;
 
@@ -43,7 +126,7 @@ int Worker::InitWorker() {
 }
 
 void Worker::Exit() {
-  std::unique_lock<std::mutex> lk(mutex_);
+  std::unique_lock<WorkerMutex> lk(mutex_);
   exit_ = true;
   if (initialized()) {
     lk.unlock();
@@ -58,7 +141,7 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
   if (should_exit())
     return -EINTR;
 
-  std::unique_lock<std::mutex> lk(mutex_, std::adopt_lock);
+  std::unique_lock<WorkerMutex> lk(mutex_, std::adopt_lock);
   if (max_nanoseconds < 0) {
     cond_.wait(lk);
   } else if (std::cv_status::timeout ==
@@ -76,11 +159,36 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
   return ret;
 }
 
+void Worker::SetScheduling() {
+  bool realtime = false;
+  if (rt_priority_ > 0) {
+    struct sched_param param = {.sched_priority = rt_priority_};
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param))
+      ALOGW("Failed to make %s SCHED_FIFO %d: %d", name_.c_str(), rt_priority_,
+            -errno);
+    else
+      realtime = true;
+  }
+  if (!realtime)
+    setpriority(PRIO_PROCESS, 0, priority_);
+
+  if (cpu_affinity_) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu)
+      if (cpu_affinity_ & (1ULL << cpu))
+        CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus))
+      ALOGW("Failed to set %s affinity to 0x%" PRIx64 ": %d", name_.c_str(),
+            cpu_affinity_, -errno);
+  }
+}
+
 void Worker::InternalRoutine() {
-  setpriority(PRIO_PROCESS, 0, priority_);
+  SetScheduling();
   prctl(PR_SET_NAME, name_.c_str());
 
-  std::unique_lock<std::mutex> lk(mutex_, std::defer_lock);
+  std::unique_lock<WorkerMutex> lk(mutex_, std::defer_lock);
 
   while (true) {
     lk.lock();
@@ -17,6 +17,7 @@
 #ifndef ANDROID_WORKER_H_
 #define ANDROID_WORKER_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string>
@@ -27,6 +28,51 @@
 
 namespace android {
 
+/*
+ * Drop-in replacement for std::mutex which can be set up to use priority
+ * inheritance, so a low priority thread holding it boosts to the priority of
+ * a real-time worker waiting on it instead of holding it off.
+ */
+class WorkerMutex {
+ public:
+  explicit WorkerMutex(bool priority_inheritance);
+  ~WorkerMutex();
+
+  WorkerMutex(const WorkerMutex &) = delete;
+  WorkerMutex &operator=(const WorkerMutex &) = delete;
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+  // Recreates the mutex, it must not be in use by any thread
+  void SetPriorityInheritance(bool priority_inheritance);
+  // Whether the mutex actually is a priority inheritance one
+  bool priority_inheritance() const {
+    return priority_inheritance_;
+  }
+
+ private:
+  void InitMutex(bool priority_inheritance);
+
+  pthread_mutex_t mutex_;
+  bool priority_inheritance_;
+};
+
+/*
+ * The scheduling of each worker thread can be tuned with properties keyed by
+ * the worker name and the display it works for:
+ *  hwc.drm.worker.<name>.<display>.rt_priority  SCHED_FIFO priority, 0 to
+ *                                               use the nice value the worker
+ *                                               was created with
+ *  hwc.drm.worker.<name>.<display>.cpu_affinity hex mask of the CPUs to run
+ *                                               on
+ *  hwc.drm.worker.<name>.<display>.pi_mutex     1 to make the worker lock a
+ *                                               priority inheritance mutex
+ * Without the display, hwc.drm.worker.<name>.<key> applies to the workers of
+ * every display that don't have a setting of their own, and to those that
+ * don't work for a display.
+ */
 class Worker {
  public:
   void Lock() {
@@ -49,7 +95,9 @@ class Worker {
   Worker(const char *name, int priority);
   virtual ~Worker();
 
-  int InitWorker();
+  // Reads the scheduling properties of display, or -1 if the worker isn't
+  // tied to one, and starts the thread.
+  int InitWorker(int display = -1);
   virtual void Routine() = 0;
 
   /*
@@ -64,14 +112,18 @@ class Worker {
     return exit_;
   }
 
-  std::mutex mutex_;
-  std::condition_variable cond_;
+  WorkerMutex mutex_;
+  std::condition_variable_any cond_;
 
  private:
   void InternalRoutine();
+  void ReadScheduling(int display);
+  void SetScheduling();
 
   std::string name_;
   int priority_;
+  int rt_priority_;
+  uint64_t cpu_affinity_;
 
   std::unique_ptr<std::thread> thread_;
   bool exit_;